@@ -10,6 +10,7 @@
 #define FDT_END_NODE 2
 #define FDT_PROP 3
 #define FDT_NOP 4
+#define FDT_END 9
 
 #define FDT_VERSION 17
 #define FDT_CELL_SIZE 4
@@ -19,7 +20,7 @@
 #define SMOLDTB_FOREACH_ABORT 1
 
 #ifndef SMOLDTB_NO_LOGGING
-    #define LOG_ERROR(msg) do { if (state.ops.on_error != NULL) { state.ops.on_error(msg); }} while(false)
+    #define LOG_ERROR(msg) do { if (state->ops.on_error != NULL) { state->ops.on_error(msg); }} while(false)
 #else
     #define LOG_ERROR(msg)
 #endif
@@ -54,49 +55,112 @@ struct fdt_property
 };
 
 /* The tree is represented in horizontal slices, where all child nodes are represented
- * in a singly-linked list. Only a pointer to the first child is stored in the parent, and
- * the list is build using the node->sibling pointer.
+ * in a doubly-linked list. Only a pointer to the first child is stored in the parent, and
+ * the list is build using the node->sibling and node->prev pointers.
  * For reference the pointer building the tree are:
  * - parent: go up one level
- * - sibling: the next node on this level. To access the previous node, access the parent and then
- *            the child pointer and iterate to just before the target.
+ * - sibling: the next node on this level.
+ * - prev: the previous node on this level, or NULL for the first child.
  * - child: the first child node.
  */
 struct dtb_node_t
 {
     dtb_node* parent;
     dtb_node* sibling;
+    dtb_node* prev;
     dtb_node* child;
     dtb_prop* props;
     const char* name;
+    uint32_t ref_slot; /* index of this node's ref slot plus 1, or 0 if it has none */
     bool fromMalloc;
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+    int lock; /* guards the child and property lists */
+#endif
 };
 
-/* Similar to nodes, properties are stored a singly linked list. */
+/* Similar to nodes, properties are stored a doubly linked list. */
 struct dtb_prop_t
 {
     dtb_node* node;
     const char* name;
     void* data;
     dtb_prop* next;
+    dtb_prop* prev;
     uint32_t length;
+    uint32_t ref_slot; /* same as for nodes */
     bool fromMalloc;
     bool dataFromMalloc;
 };
 
+/* Phandles are looked up via an open-addressed hash table (with linear probing).
+ * An empty slot is indicated by node being NULL.
+ */
+struct dtb_handle_slot
+{
+    uint32_t handle;
+    dtb_node* node;
+};
+
 /* Info for initializing the global state during init */
 struct dtb_init_info
 {
     const uint32_t* cells;
     const char* strings;
     size_t cell_count;
+    size_t strings_size;
+};
+
+/* Progress of an incremental init. Instead of recursing, the parser keeps the innermost
+ * open node: its ancestors (via the parent pointers) form the rest of the parse stack.
+ */
+#define PARSE_IDLE 0
+#define PARSE_SIZING 1
+#define PARSE_NODES 2
+#define PARSE_FAILED 3
+
+#define SMOLDTB_FILTER_PATH_MAX 256
+
+struct dtb_parse_state
+{
+    struct dtb_init_info info;
+    size_t offset;
+    size_t handle_props;
+    dtb_node* current;
+    size_t depth;
+    int phase;
+
+    /* Only used when filtering. Skipped subtrees are walked by counting their depth, and
+     * once a node matches one of the keep paths its whole subtree is kept. */
+    const dtb_parse_filter* filter;
+    size_t skip_depth;
+    size_t match_depth;
+    size_t path_depth;
+    size_t path_len;
+    char path[SMOLDTB_FILTER_PATH_MAX];
+};
+
+/* Extra blocks of memory owned by a context (e.g. from bulk building), these are
+ * released along with the main arena.
+ */
+struct dtb_arena_chunk
+{
+    struct dtb_arena_chunk* next;
+    size_t size;
 };
 
-/* Global parser state */
-struct dtb_state
+/* Parser state, one per context. The public API always operates on the currently
+ * selected context, which is the built-in default context unless the caller has
+ * chosen another with dtb_ctx_select().
+ */
+struct dtb_ctx_t
 {
     dtb_node* root;
-    dtb_node** handle_lookup;
+    struct dtb_handle_slot* handle_lookup;
+    size_t handle_capacity;
+    size_t handle_count;
+    uint32_t handle_max;
+    uint32_t handle_free_hint;
+    bool handlesFromMalloc;
     dtb_node* node_buff;
     size_t node_alloc_head;
     size_t node_alloc_max;
@@ -104,10 +168,40 @@ struct dtb_state
     size_t prop_alloc_head;
     size_t prop_alloc_max;
 
+    size_t arena_size;
+    bool arenaFromMalloc;
+    struct dtb_arena_chunk* chunks;
+
+    struct compat_index* compat_index;
+    int compat_index_state;
+    struct path_index* path_index;
+    int path_index_state;
+    bool indexesDeferred;
+
+    struct dtb_ref_table* refs;
+
+    int lock; /* guards the phandle table, indexes, undo log and arena chunks */
+    int root_lock; /* guards the list of top-level nodes */
+
+    struct dtb_undo_entry* undo_log;
+    size_t undo_count;
+    size_t undo_capacity;
+    size_t snapshot_count;
+
+    struct dtb_parse_state parse;
+
     dtb_ops ops;
 };
 
-struct dtb_state state;
+static dtb_ctx default_ctx;
+static dtb_ctx* state = &default_ctx;
+
+/* The context that lookups starting from the root (or a phandle) use. This is always
+ * the same as `state`, except while smoldtb_reinit_atomic() is building a new tree in the
+ * background: `state` then points to the new context, while readers keep using the old one
+ * until it's published.
+ */
+static dtb_ctx* published = &default_ctx;
 
 #ifdef SMOLDTB_STATIC_BUFFER_SIZE
     uint8_t big_buff[SMOLDTB_STATIC_BUFFER_SIZE];
@@ -115,10 +209,74 @@ struct dtb_state state;
 
 /* ---- Section: Utility Functions ---- */
 
+#ifdef __GNUC__
+    #define ATOMIC_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+    #define ATOMIC_STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+    #define ATOMIC_ADD(ptr, val) __atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+    #define ATOMIC_SUB(ptr, val) __atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+    #define ATOMIC_CAS(ptr, expected, desired) \
+        __atomic_compare_exchange_n(ptr, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#else
+    /* without compiler support the library is only safe for single threaded use */
+    #define ATOMIC_LOAD(ptr) (*(ptr))
+    #define ATOMIC_STORE(ptr, val) (*(ptr) = (val))
+    #define ATOMIC_ADD(ptr, val) (*(ptr) += (val))
+    #define ATOMIC_SUB(ptr, val) (*(ptr) -= (val))
+    #define ATOMIC_CAS(ptr, expected, desired) \
+        (*(ptr) == *(expected) ? (*(ptr) = (desired), true) : (*(expected) = *(ptr), false))
+#endif
+
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+    #define LOCK(lock) spin_lock(lock)
+    #define UNLOCK(lock) ATOMIC_STORE(lock, 0)
+#else
+    /* the argument isn't evaluated, node locks only exist with concurrent writes */
+    #define LOCK(lock) ((void)0)
+    #define UNLOCK(lock) ((void)0)
+#endif
+
+static dtb_ctx* read_state()
+{
+#ifdef __GNUC__
+    return __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+#else
+    return published;
+#endif
+}
+
+static void publish_state(dtb_ctx* ctx)
+{
+#ifdef __GNUC__
+    __atomic_store_n(&published, ctx, __ATOMIC_RELEASE);
+#else
+    published = ctx;
+#endif
+}
+
+/* Switches the context used internally, without changing what readers see. */
+static dtb_ctx* swap_state(dtb_ctx* ctx)
+{
+    dtb_ctx* prev = state;
+    state = ctx;
+    return prev;
+}
+
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+/* Locks are only held for short list and table updates, so spinning is fine. */
+static void spin_lock(int* lock)
+{
+    int expected = 0;
+    while (!ATOMIC_CAS(lock, &expected, 1))
+        expected = 0;
+}
+#endif
+
 static uint32_t be32(uint32_t input)
 {
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
     return input;
+#elif defined(__GNUC__)
+    return __builtin_bswap32(input);
 #else
     uint32_t temp = 0;
     temp |= (input & 0xFF) << 24;
@@ -151,6 +309,20 @@ static void* memcpy(void* dest, const void* src, size_t count)
     return dest;
 }
 
+static bool memory_eq(const void* a, const void* b, size_t count)
+{
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (x[i] != y[i])
+            return false;
+    }
+
+    return true;
+}
+
 static bool strings_eq(const char* a, const char* b, size_t len)
 {
     for (size_t i = 0; i < len; i++)
@@ -181,6 +353,89 @@ static size_t dtb_align_up(size_t input, size_t alignment)
     return ((input + alignment - 1) / alignment) * alignment;
 }
 
+/* Matches the first `str_len` characters of `str` against a glob pattern, where '*' matches
+ * any number of characters and '?' matches exactly one. */
+static bool glob_matches_n(const char* pattern, size_t pattern_len, const char* str, size_t str_len)
+{
+    size_t p = 0;
+    size_t s = 0;
+    size_t star = -1ul;
+    size_t star_s = 0;
+
+    while (s < str_len)
+    {
+        if (p < pattern_len && pattern[p] == '*')
+        {
+            star = p++;
+            star_s = s;
+        }
+        else if (p < pattern_len && (pattern[p] == '?' || pattern[p] == str[s]))
+        {
+            p++;
+            s++;
+        }
+        else if (star != -1ul)
+        {
+            p = star + 1;
+            s = ++star_s;
+        }
+        else
+            return false;
+    }
+
+    while (p < pattern_len && pattern[p] == '*')
+        p++;
+    return p == pattern_len;
+}
+
+static bool glob_matches(const char* pattern, const char* str)
+{
+    return glob_matches_n(pattern, string_len(pattern), str, string_len(str));
+}
+
+static bool glob_list_matches(const char* const* patterns, const char* str)
+{
+    if (patterns == NULL)
+        return false;
+
+    for (size_t i = 0; patterns[i] != NULL; i++)
+    {
+        if (glob_matches(patterns[i], str))
+            return true;
+    }
+
+    return false;
+}
+
+/* Checks whether `path` could be an ancestor of a path matching `pattern`: the pattern has
+ * more segments than the path, and the ones they share match. */
+static bool glob_matches_ancestor(const char* pattern, const char* path)
+{
+    while (true)
+    {
+        while (*pattern == '/')
+            pattern++;
+        while (*path == '/')
+            path++;
+        if (*path == 0)
+            return *pattern != 0;
+        if (*pattern == 0)
+            return false;
+
+        size_t pattern_len = 0;
+        while (pattern[pattern_len] != 0 && pattern[pattern_len] != '/')
+            pattern_len++;
+        size_t path_len = 0;
+        while (path[path_len] != 0 && path[path_len] != '/')
+            path_len++;
+
+        if (!glob_matches_n(pattern, pattern_len, path, path_len))
+            return false;
+        pattern += pattern_len;
+        path += path_len;
+    }
+}
+
 static void do_foreach_sibling(dtb_node* begin, int (*action)(dtb_node* node, void* opaque), void* opaque)
 {
     if (begin == NULL)
@@ -188,8 +443,10 @@ static void do_foreach_sibling(dtb_node* begin, int (*action)(dtb_node* node, vo
     if (action == NULL)
         return;
 
-    for (dtb_node* node = begin; node != NULL; node = node->sibling)
+    dtb_node* next = NULL;
+    for (dtb_node* node = begin; node != NULL; node = next)
     {
+        next = node->sibling; /* cache the next node incase the action frees this one */
         if (action(node, opaque) == SMOLDTB_FOREACH_ABORT)
             return;
     }
@@ -204,8 +461,10 @@ static void do_foreach_prop(dtb_node* node, int (*action)(dtb_node* node, dtb_pr
     if (action == NULL)
         return;
 
-    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+    dtb_prop* next = NULL;
+    for (dtb_prop* prop = node->props; prop != NULL; prop = next)
     {
+        next = prop->next;
         if (action(node, prop, opaque) == SMOLDTB_FOREACH_ABORT)
             return;
     }
@@ -221,8 +480,8 @@ static uintmax_t extract_cells(const uint32_t* cells, size_t count)
 
 static void* try_malloc(size_t count)
 {
-    if (state.ops.malloc != NULL)
-        return state.ops.malloc(count);
+    if (state->ops.malloc != NULL)
+        return state->ops.malloc(count);
 
     LOG_ERROR("try_malloc() called but state.ops.malloc is NULL");
     return NULL;
@@ -230,18 +489,110 @@ static void* try_malloc(size_t count)
 
 static void try_free(void* ptr, size_t count)
 {
-    if (state.ops.free != NULL)
-        state.ops.free(ptr, count);
+    if (state->ops.free != NULL)
+    {
+        state->ops.free(ptr, count);
+        return;
+    }
 
     LOG_ERROR("try_free() called but state.ops.free is NULL");
 }
 
 /* ---- Section: Readonly-Mode Private Functions ---- */
 
+static void index_linked_node(dtb_node* node);
+static void index_compat_changed(dtb_node* node, bool add);
+
+/* Inserts a node into the parent's list of children (or the list of top-level nodes if
+ * parent is NULL), directly after `prev`. If prev is NULL the node becomes the first child.
+ */
+static void link_node(dtb_node* parent, dtb_node* prev, dtb_node* node)
+{
+    dtb_node** head = (parent == NULL) ? &state->root : &parent->child;
+
+    node->parent = parent;
+    node->prev = prev;
+    node->sibling = (prev == NULL) ? *head : prev->sibling;
+    if (node->sibling != NULL)
+        node->sibling->prev = node;
+
+    if (prev == NULL)
+        *head = node;
+    else
+        prev->sibling = node;
+    index_linked_node(node);
+}
+
+/* Inserts a property into the node's list after `prev`. A new compatible property replaces the
+ * node's entries in the compatible index, check_for_special_prop() adds them back afterwards.
+ */
+static void link_prop(dtb_node* node, dtb_prop* prev, dtb_prop* prop)
+{
+    if (prop->name[0] == 'c' && strings_eq(prop->name, "compatible", sizeof("compatible")))
+        index_compat_changed(node, false);
+    prop->node = node;
+    prop->prev = prev;
+    prop->next = (prev == NULL) ? node->props : prev->next;
+    if (prop->next != NULL)
+        prop->next->prev = prop;
+
+    if (prev == NULL)
+        node->props = prop;
+    else
+        prev->next = prop;
+}
+
+#ifdef SMOLDTB_ENABLE_WRITE_API
+static void index_unlinking_node(dtb_node* node);
+
+static void unlink_node(dtb_node* node)
+{
+    index_unlinking_node(node);
+    if (node->prev != NULL)
+        node->prev->sibling = node->sibling;
+    else if (node->parent != NULL)
+        node->parent->child = node->sibling;
+    else if (state->root == node)
+        state->root = node->sibling;
+
+    if (node->sibling != NULL)
+        node->sibling->prev = node->prev;
+    node->prev = NULL;
+    node->sibling = NULL;
+}
+
+static void unlink_prop(dtb_prop* prop)
+{
+    const bool is_compat = strings_eq(prop->name, "compatible", sizeof("compatible"));
+    if (is_compat)
+        index_compat_changed(prop->node, false);
+    if (prop->prev != NULL)
+        prop->prev->next = prop->next;
+    else
+        prop->node->props = prop->next;
+
+    if (prop->next != NULL)
+        prop->next->prev = prop->prev;
+    prop->prev = NULL;
+    prop->next = NULL;
+    if (is_compat)
+        index_compat_changed(prop->node, true); //another compatible property may take over
+}
+
+static void destroy_dead_node(dtb_node* node);
+static int destroy_props(dtb_node* node, dtb_prop* prop, void* opaque);
+static void discard_undo_log();
+static bool is_logging_undo();
+#endif
+
 static dtb_node* alloc_node()
 {
-    if (state.node_alloc_head + 1 < state.node_alloc_max)
-        return &state.node_buff[state.node_alloc_head++];
+    if (state->node_alloc_head < state->node_alloc_max)
+    {
+        dtb_node* node = &state->node_buff[state->node_alloc_head++];
+        node->ref_slot = 0;
+        return node;
+    }
 
     LOG_ERROR("Not enough space for source dtb node.");
     return NULL;
@@ -249,1127 +600,6630 @@ static dtb_node* alloc_node()
 
 static dtb_prop* alloc_prop()
 {
-    if (state.prop_alloc_head + 1 < state.prop_alloc_max)
-        return &state.prop_buff[state.prop_alloc_head++];
+    if (state->prop_alloc_head < state->prop_alloc_max)
+    {
+        dtb_prop* prop = &state->prop_buff[state->prop_alloc_head++];
+        prop->ref_slot = 0;
+        return prop;
+    }
 
     LOG_ERROR("Not enough space for source dtb property.");
     return NULL;
 }
 
-static void free_buffers()
+static bool is_phandle_name(const char* name)
 {
-#ifndef SMOLDTB_STATIC_BUFFER_SIZE
-    size_t buff_size = state.node_alloc_max * sizeof(dtb_node);
-    buff_size += state.prop_alloc_max * sizeof(dtb_prop);
-    buff_size += state.node_alloc_max * sizeof(void*);
+    const char str_phandle[] = "phandle";
+    const char str_lhandle[] = "linux,phandle";
 
-    try_free(state.node_buff, buff_size);
-    state.node_buff = NULL;
-    state.prop_buff = NULL;
-    state.handle_lookup = NULL;
-#endif
+    const size_t name_len = string_len(name);
+    if (name_len == sizeof(str_phandle) - 1 && strings_eq(name, str_phandle, name_len))
+        return true;
+    if (name_len == sizeof(str_lhandle) - 1 && strings_eq(name, str_lhandle, name_len))
+        return true;
+    return false;
+}
 
-    state.node_alloc_head = state.node_alloc_max = 0;
-    state.prop_alloc_head = state.prop_alloc_max = 0;
+static uint32_t read_phandle_value(dtb_prop* prop)
+{
+    if (prop->length != FDT_CELL_SIZE || prop->data == NULL)
+        return 0;
+    return be32(*(const uint32_t*)prop->data);
 }
 
-static bool alloc_buffers(struct dtb_init_info* init_info)
+static size_t phandle_slot_for(uint32_t handle, size_t capacity)
 {
-    state.node_alloc_max = 0;
-    state.prop_alloc_max = 0;
-    for (size_t i = 0; i < init_info->cell_count; i++)
-    {
-        if (be32(init_info->cells[i]) == FDT_BEGIN_NODE)
-            state.node_alloc_max++;
-        else if (be32(init_info->cells[i]) == FDT_PROP)
-            state.prop_alloc_max++;
-    }
+    return (size_t)(handle * 2654435761u) & (capacity - 1);
+}
 
-    size_t total_size = state.node_alloc_max * sizeof(dtb_node);
-    total_size += state.prop_alloc_max * sizeof(dtb_prop);
-    total_size += state.node_alloc_max * sizeof(void*); //we assume the worst case and that each node has a phandle prop
+static struct dtb_handle_slot* find_phandle_slot(dtb_ctx* ctx, uint32_t handle)
+{
+    if (ctx->handle_capacity == 0)
+        return NULL;
 
-#ifdef SMOLDTB_STATIC_BUFFER_SIZE
-    if (total_size >= SMOLDTB_STATIC_BUFFER_SIZE)
-    {
-        LOG_ERROR("Too much data for statically allocated buffer.");
-        return false;
-    }
-    uint8_t* buffer = big_buff;
-#else
-    uint8_t* buffer = try_malloc(total_size);
-    if (buffer == NULL)
+    size_t index = phandle_slot_for(handle, ctx->handle_capacity);
+    while (ctx->handle_lookup[index].node != NULL)
     {
-        LOG_ERROR("Failed to allocate big buffer.");
-        return false;
+        if (ctx->handle_lookup[index].handle == handle)
+            return &ctx->handle_lookup[index];
+        index = (index + 1) & (ctx->handle_capacity - 1);
     }
-#endif
-
-    for (size_t i = 0; i < total_size; i++)
-        buffer[i] = 0;
 
-    state.node_buff = (dtb_node*)buffer;
-    state.node_alloc_head = 0;
-    state.prop_buff = (dtb_prop*)&state.node_buff[state.node_alloc_max];
-    state.prop_alloc_head = 0;
-    state.handle_lookup = (dtb_node**)&state.prop_buff[state.prop_alloc_max];
-
-    return true;
+    return NULL;
 }
 
-/* This runs on every new property found, and handles some special cases for us. */
-static void check_for_special_prop(dtb_node* node, dtb_prop* prop)
+static void store_phandle_slot(uint32_t handle, dtb_node* node)
 {
-    const char name0 = prop->name[0];
-    if (name0 != 'p' || name0 != 'l')
-        return; //short circuit to save processing
-
-    const size_t name_len = string_len(prop->name);
+    size_t index = phandle_slot_for(handle, state->handle_capacity);
+    while (state->handle_lookup[index].node != NULL && state->handle_lookup[index].handle != handle)
+        index = (index + 1) & (state->handle_capacity - 1);
+
+    if (state->handle_lookup[index].node == NULL)
+        state->handle_count++;
+    state->handle_lookup[index].handle = handle;
+    state->handle_lookup[index].node = node;
+}
 
-    const char str_phandle[] = "phandle";
-    const size_t len_phandle = sizeof(str_phandle) - 1;
-    if (name_len == len_phandle && strings_eq(prop->name, str_phandle, name_len))
+/* Parse-time tables are sized so they never need to grow, so this only happens when
+ * phandles are added via the write API, where we know malloc() is available.
+ */
+static bool grow_phandle_table()
+{
+    const size_t new_capacity = state->handle_capacity == 0 ? 8 : state->handle_capacity * 2;
+    struct dtb_handle_slot* new_table = try_malloc(new_capacity * sizeof(struct dtb_handle_slot));
+    if (new_table == NULL)
     {
-        size_t handle;
-        dtb_read_prop_1(prop, 1, &handle);
-        state.handle_lookup[handle] = node;
-        return;
+        LOG_ERROR("Failed to grow phandle table.");
+        return false;
     }
-
-    const char str_lhandle[] = "linux,phandle";
-    const size_t len_lhandle = sizeof(str_lhandle) - 1;
-    if (name_len == len_lhandle && strings_eq(prop->name, str_lhandle, name_len))
+    for (size_t i = 0; i < new_capacity; i++)
+        new_table[i].node = NULL;
+
+    struct dtb_handle_slot* old_table = state->handle_lookup;
+    const size_t old_capacity = state->handle_capacity;
+    const bool old_from_malloc = state->handlesFromMalloc;
+
+    state->handle_lookup = new_table;
+    state->handle_capacity = new_capacity;
+    state->handle_count = 0;
+    state->handlesFromMalloc = true;
+    for (size_t i = 0; i < old_capacity; i++)
     {
-        size_t handle;
-        dtb_read_prop_1(prop, 1, &handle);
-        state.handle_lookup[handle] = node;
-        return;
+        if (old_table[i].node != NULL)
+            store_phandle_slot(old_table[i].handle, old_table[i].node);
     }
+
+    if (old_from_malloc)
+        try_free(old_table, old_capacity * sizeof(struct dtb_handle_slot));
+    return true;
 }
 
-static dtb_prop* parse_prop(struct dtb_init_info* init_info, size_t* offset)
+static bool insert_phandle(uint32_t handle, dtb_node* node)
 {
-    if (be32(init_info->cells[*offset]) != FDT_PROP)
-        return NULL;
+    if (handle == 0 || handle == 0xFFFFFFFF)
+        return false;
 
-    (*offset)++;
-    dtb_prop* prop = alloc_prop();
-    if (prop == NULL)
+    LOCK(&state->lock);
+    if ((state->handle_count + 1) * 2 > state->handle_capacity && !grow_phandle_table())
     {
-        LOG_ERROR("Property allocation failed");
-        return NULL;
+        UNLOCK(&state->lock);
+        return false;
     }
 
-    const struct fdt_property* fdtprop = (struct fdt_property*)(init_info->cells + *offset);
-    prop->name = (const char*)(init_info->strings + be32(fdtprop->name_offset));
-    prop->data = (void*)(init_info->cells + *offset + 2);
-    prop->length = be32(fdtprop->length);
-    prop->fromMalloc = false;
-    prop->dataFromMalloc = false;
-    (*offset) += (dtb_align_up(be32(fdtprop->length), 4) / 4) + 2;
-    
-    return prop;
+    store_phandle_slot(handle, node);
+    if (handle > state->handle_max)
+        state->handle_max = handle;
+    UNLOCK(&state->lock);
+    return true;
 }
 
-static dtb_node* parse_node(struct dtb_init_info* init_info, size_t* offset)
+#ifdef SMOLDTB_ENABLE_WRITE_API
+/* Removes the entry for a handle, but only if it still refers to the expected node. */
+static void remove_phandle(uint32_t handle, dtb_node* node)
 {
-    if (be32(init_info->cells[*offset]) != FDT_BEGIN_NODE)
-        return NULL;
-
-    dtb_node* node = alloc_node(); 
-    if (node == NULL)
+    LOCK(&state->lock);
+    struct dtb_handle_slot* slot = find_phandle_slot(state, handle);
+    if (slot == NULL || slot->node != node)
     {
-        LOG_ERROR("Node allocation failed");
-        return NULL;
+        UNLOCK(&state->lock);
+        return;
     }
-    node->name = (const char*)(init_info->cells + (*offset) + 1);
-    node->fromMalloc = false;
-
-    const size_t name_len = string_len(node->name);
-    if (name_len == 0)
-        node->name = NULL;
-    *offset += (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
 
-    while (*offset < init_info->cell_count)
+    /* backward-shift deletion: move later entries of the probe sequence into the hole */
+    const size_t mask = state->handle_capacity - 1;
+    size_t hole = slot - state->handle_lookup;
+    size_t scan = (hole + 1) & mask;
+    while (state->handle_lookup[scan].node != NULL)
     {
-        const uint32_t test = be32(init_info->cells[*offset]);
-        if (test == FDT_END_NODE)
+        const size_t home = phandle_slot_for(state->handle_lookup[scan].handle, mask + 1);
+        if (((scan - home) & mask) >= ((scan - hole) & mask))
         {
-            (*offset)++;
-            return node;
+            state->handle_lookup[hole] = state->handle_lookup[scan];
+            hole = scan;
         }
-        else if (test == FDT_BEGIN_NODE)
-        {
-            dtb_node* child = parse_node(init_info, offset);
-            if (child == NULL)
-                continue;
+        scan = (scan + 1) & mask;
+    }
 
-            child->sibling = node->child;
-            node->child = child;
-            child->parent = node;
-        }
-        else if (test == FDT_PROP)
-        {
-            dtb_prop* prop = parse_prop(init_info, offset);
-            if (prop == NULL)
-                continue;
+    state->handle_lookup[hole].node = NULL;
+    state->handle_count--;
+    if (handle < state->handle_free_hint)
+        state->handle_free_hint = handle;
+    UNLOCK(&state->lock);
+}
+#endif
 
-            prop->next = node->props;
-            prop->node = node;
-            node->props = prop;
-            check_for_special_prop(node, prop);
-    }
-        else
-            (*offset)++;
+/* Returns the next node in a depth-first walk of the tree. Walking the tree (rather than
+ * the node buffer) means nodes added with the write API are visited too.
+ */
+static dtb_node* next_node_preorder(dtb_node* node)
+{
+    if (node->child != NULL)
+        return node->child;
+
+    while (node != NULL)
+    {
+        if (node->sibling != NULL)
+            return node->sibling;
+        node = node->parent;
     }
 
-    LOG_ERROR("Node is missing terminating tag.");
     return NULL;
 }
 
-/* ---- Section: Readonly-Mode Public API ---- */
+/* The compatible index maps each compatible string to the nodes that list it, in the same
+ * (depth-first) order dtb_find_compatible() would find them. It's built on first use (or by
+ * dtb_build_indexes() if the indexes are deferred), and then kept up to date as the tree is
+ * modified: linking or unlinking a node, or changing a compatible property, only touches the
+ * chains of the strings involved. Building uses ops.malloc(), if that isn't available lookups
+ * always take the linear path.
+ */
+#define INDEX_NONE 0
+#define INDEX_BUILDING 1
+#define INDEX_READY 2
+#define INDEX_UNAVAILABLE 3
 
-size_t dtb_query_total_size(uintptr_t fdt_start)
+struct compat_entry
 {
-    if (fdt_start == 0)
-        return 0;
+    const char* str;
+    dtb_node* node;
+    size_t next;
+    size_t prev;
+};
 
-    struct fdt_header* header = (struct fdt_header*)fdt_start;
-    if (be32(header->magic) != FDT_MAGIC)
-        return 0;
+/* Entries are allocated with some room to spare so nodes can be added without rebuilding,
+ * the index is dropped (and rebuilt by the next lookup) once that runs out. Removed entries
+ * are kept on a free list, chained through `next`.
+ */
+struct compat_index
+{
+    size_t size;
+    size_t entry_capacity;
+    size_t free_head;
+    size_t capacity;
+    size_t* heads;
+    size_t* tails;
+    struct compat_entry* entries;
+};
 
-    return be32(header->total_size);
+typedef bool (*compat_action)(struct compat_index* index, dtb_node* node, const char* str, size_t str_len);
+
+static size_t compat_hash(const char* str)
+{
+    uint32_t hash = 2166136261u;
+    for (; *str != 0; str++)
+        hash = (hash ^ (uint8_t)*str) * 16777619u;
+    return hash;
 }
 
-bool smoldtb_init(uintptr_t start, dtb_ops ops)
+/* Returns the key slot holding the chain for `str`, or the empty slot it would go in. */
+static size_t compat_key_slot(struct compat_index* index, const char* str, size_t str_len)
 {
-    state.ops = ops;
+    const size_t slot_mask = index->capacity - 1;
+    size_t slot = compat_hash(str) & slot_mask;
+    while (index->heads[slot] != -1ul && !strings_eq(index->entries[index->heads[slot]].str, str, str_len + 1))
+        slot = (slot + 1) & slot_mask;
+    return slot;
+}
 
-#if !defined(SMOLDTB_STATIC_BUFFER_SIZE)
-    if (state.ops.malloc == NULL)
+/* Returns true if `a` comes before `b` in a depth-first walk of the tree. */
+static bool node_precedes(dtb_node* a, dtb_node* b)
+{
+    size_t a_depth = 0;
+    size_t b_depth = 0;
+    for (dtb_node* scan = a->parent; scan != NULL; scan = scan->parent)
+        a_depth++;
+    for (dtb_node* scan = b->parent; scan != NULL; scan = scan->parent)
+        b_depth++;
+
+    dtb_node* x = a;
+    dtb_node* y = b;
+    for (size_t i = a_depth; i > b_depth; i--)
+        x = x->parent;
+    for (size_t i = b_depth; i > a_depth; i--)
+        y = y->parent;
+    if (x == y)
+        return a_depth < b_depth; //one is an ancestor of the other
+
+    while (x->parent != y->parent)
     {
-        LOG_ERROR("smoldtb has been compiled without an internal static buffer, but not passed a malloc() function.");
-        return false;
+        x = x->parent;
+        y = y->parent;
     }
-#endif
 
-    struct dtb_init_info init_info;
-    if (start == SMOLDTB_INIT_EMPTY_TREE)
+    /* x and y are siblings now, search outwards from x. Running off either end of the list
+     * also gives the answer, so this stops at whichever is closest: y or an end.
+     */
+    dtb_node* fwd = x->sibling;
+    dtb_node* back = x->prev;
+    while (true)
     {
-        state.root = NULL;
-        return true;
+        if (fwd == y)
+            return true;
+        if (back == y || fwd == NULL)
+            return false;
+        if (back == NULL)
+            return true;
+        fwd = fwd->sibling;
+        back = back->prev;
     }
+}
 
-    struct fdt_header* header = (struct fdt_header*)start;
-    if (be32(header->magic) != FDT_MAGIC)
+/* Finds the last entry in a chain whose node comes before `node`, or -1 if there isn't one.
+ * New nodes usually land near one end of a chain, so it's walked from both ends at once.
+ */
+static size_t compat_insert_position(struct compat_index* index, size_t slot, dtb_node* node)
+{
+    size_t head = index->heads[slot];
+    size_t tail = index->tails[slot];
+    while (true)
     {
-        LOG_ERROR("FDT has incorrect magic number.");
-        return false;
-    }
+        if (node_precedes(index->entries[tail].node, node))
+            return tail;
+        tail = index->entries[tail].prev;
+        if (tail == -1ul)
+            return -1ul;
 
-    init_info.cells = (const uint32_t*)(start + be32(header->offset_structs));
-    init_info.cell_count = be32(header->size_structs) / sizeof(uint32_t);
-    init_info.strings = (const char*)(start + be32(header->offset_strings));
+        if (!node_precedes(index->entries[head].node, node))
+            return index->entries[head].prev;
+        head = index->entries[head].next;
+    }
+}
 
-    if (state.node_buff != NULL)
-        free_buffers();
-    if (!alloc_buffers(&init_info))
+/* Adds an entry to the chain for `str`. While building nodes arrive in depth-first order and
+ * are appended, otherwise the entry is placed by the node's position in the tree.
+ */
+static bool compat_insert(struct compat_index* index, dtb_node* node, const char* str, size_t str_len, bool append)
+{
+    size_t entry;
+    if (index->free_head != -1ul)
     {
-        LOG_ERROR("failed to allocate readonly buffer");
+        entry = index->free_head;
+        index->free_head = index->entries[entry].next;
+    }
+    else if (index->size < index->entry_capacity)
+        entry = index->size++;
+    else
+        return false;
+
+    const size_t slot = compat_key_slot(index, str, str_len);
+    size_t after = -1ul;
+    if (index->heads[slot] != -1ul)
+        after = append ? index->tails[slot] : compat_insert_position(index, slot, node);
+
+    struct compat_entry* ent = &index->entries[entry];
+    ent->str = str;
+    ent->node = node;
+    ent->prev = after;
+    ent->next = (after == -1ul) ? index->heads[slot] : index->entries[after].next;
+    if (after == -1ul)
+        index->heads[slot] = entry;
+    else
+        index->entries[after].next = entry;
+    if (ent->next == -1ul)
+        index->tails[slot] = entry;
+    else
+        index->entries[ent->next].prev = entry;
+
+    return true;
+}
+
+static bool compat_append(struct compat_index* index, dtb_node* node, const char* str, size_t str_len)
+{
+    return compat_insert(index, node, str, str_len, true);
+}
+
+static bool compat_insert_ordered(struct compat_index* index, dtb_node* node, const char* str, size_t str_len)
+{
+    return compat_insert(index, node, str, str_len, false);
+}
+
+/* Removes one of the node's entries from the chain for `str`, returns false if there isn't one. */
+static bool compat_remove(struct compat_index* index, dtb_node* node, const char* str, size_t str_len)
+{
+    const size_t slot = compat_key_slot(index, str, str_len);
+    if (index->heads[slot] == -1ul)
         return false;
+
+    size_t entry = -1ul;
+    for (size_t head = index->heads[slot], tail = index->tails[slot]; ;
+        head = index->entries[head].next, tail = index->entries[tail].prev)
+    {
+        if (index->entries[head].node == node)
+            entry = head;
+        else if (index->entries[tail].node == node)
+            entry = tail;
+        if (entry != -1ul || head == tail || index->entries[head].next == tail)
+            break;
     }
+    if (entry == -1ul)
+        return false;
 
-    for (size_t i = 0; i < init_info.cell_count; i++)
+    struct compat_entry* ent = &index->entries[entry];
+    if (ent->prev == -1ul)
+        index->heads[slot] = ent->next;
+    else
+        index->entries[ent->prev].next = ent->next;
+    if (ent->next == -1ul)
+        index->tails[slot] = ent->prev;
+    else
+        index->entries[ent->next].prev = ent->prev;
+    ent->node = NULL;
+    ent->next = index->free_head;
+    index->free_head = entry;
+
+    if (index->heads[slot] != -1ul)
+        return true;
+
+    //that was the last node with this string, close the gap in the key slots behind it
+    const size_t slot_mask = index->capacity - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & slot_mask; index->heads[next] != -1ul; next = (next + 1) & slot_mask)
     {
-        if (be32(init_info.cells[i]) != FDT_BEGIN_NODE)
+        const size_t home = compat_hash(index->entries[index->heads[next]].str) & slot_mask;
+        if (((next - home) & slot_mask) < ((next - hole) & slot_mask))
             continue;
 
-        dtb_node* sub_root = parse_node(&init_info, &i);
-        if (sub_root == NULL)
-            continue;
-        sub_root->sibling = state.root;
-        state.root = sub_root;
+        index->heads[hole] = index->heads[next];
+        index->tails[hole] = index->tails[next];
+        hole = next;
     }
+    index->heads[hole] = -1ul;
 
     return true;
 }
 
-dtb_node* dtb_find_compatible(dtb_node* start, const char* str)
+/* Counts the strings in a node's compatible property, passing each one to `action` if it's not
+ * NULL. Returns -1 if the action fails.
+ */
+static size_t foreach_compat_string(dtb_node* node, struct compat_index* index, compat_action action)
 {
-    size_t begin_index = 0;
-    if (start != NULL)
+    dtb_prop* prop = NULL;
+    for (dtb_prop* scan = node->props; scan != NULL; scan = scan->next)
     {
-        const uintptr_t offset = (uintptr_t)start - (uintptr_t)state.node_buff;
-        begin_index = offset / sizeof(dtb_node);
-        begin_index++; //we want to start searching AFTER this node.
+        if (strings_eq(scan->name, "compatible", sizeof("compatible")))
+            prop = scan;
     }
+    if (prop == NULL || prop->length == 0)
+        return 0;
 
-    for (size_t i = begin_index; i < state.node_alloc_head; i++)
+    const char* data = prop->data;
+    size_t count = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < prop->length; i++)
     {
-        dtb_node* node = &state.node_buff[i];
-        if (dtb_is_compatible(node, str))
-            return node;
+        if (data[i] != 0)
+            continue;
+
+        if (action != NULL && !action(index, node, data + start, i - start))
+            return -1ul;
+        count++;
+        start = i + 1;
     }
 
-    return NULL;
-} 
+    return count;
+}
 
-dtb_node* dtb_find_phandle(unsigned handle)
+static struct compat_index* build_compat_index(dtb_ctx* ctx)
 {
-    if (handle < state.node_alloc_max)
-        return state.handle_lookup[handle];
+    if (ctx->ops.malloc == NULL || ctx->ops.free == NULL)
+        return NULL;
 
-    return NULL;
+    size_t count = 0;
+    for (dtb_node* scan = ctx->root; scan != NULL; scan = next_node_preorder(scan))
+        count += foreach_compat_string(scan, NULL, NULL);
+
+    const size_t entry_capacity = count + count / 2 + 8;
+    size_t capacity = 8;
+    while (capacity < entry_capacity * 2)
+        capacity *= 2;
+
+    const size_t total_size = sizeof(struct compat_index) + entry_capacity * sizeof(struct compat_entry)
+        + capacity * sizeof(size_t) * 2;
+    struct compat_index* index = ctx->ops.malloc(total_size);
+    if (index == NULL)
+        return NULL;
+
+    index->size = 0;
+    index->entry_capacity = entry_capacity;
+    index->free_head = -1ul;
+    index->capacity = capacity;
+    index->entries = (struct compat_entry*)(index + 1);
+    index->heads = (size_t*)(index->entries + entry_capacity);
+    index->tails = index->heads + capacity;
+    for (size_t i = 0; i < capacity; i++)
+        index->heads[i] = -1ul;
+
+    for (dtb_node* scan = ctx->root; scan != NULL; scan = next_node_preorder(scan))
+        foreach_compat_string(scan, index, compat_append);
+
+    return index;
 }
 
-static dtb_node* find_child_internal(dtb_node* start, const char* name, size_t name_bounds)
+static size_t compat_index_bytes(struct compat_index* index)
 {
-    dtb_node* scan = start->child;
-    while (scan != NULL)
-    {
-        size_t child_name_len = string_find_char(scan->name, '@');
-        if (child_name_len == -1ul)
-            child_name_len = string_len(scan->name);
+    return sizeof(struct compat_index) + index->entry_capacity * sizeof(struct compat_entry)
+        + index->capacity * sizeof(size_t) * 2;
+}
 
-        if (child_name_len == name_bounds && strings_eq(scan->name, name, name_bounds))
-            return scan;
+/* Path index: maps the hash of each node's full path to the node, so dtb_find() doesn't have
+ * to search every level of the tree. Queries that leave out a unit address won't be found
+ * in the index, and fall back to the linear path. The index only answers when the linear
+ * path would find the same node, see path_matches(). Like the compatible index it's built
+ * with room to spare and updated as nodes are linked and unlinked.
+ */
+struct path_entry
+{
+    size_t hash;
+    dtb_node* node;
+};
 
-        scan = scan->sibling;
-    }
+struct path_index
+{
+    size_t capacity;
+    size_t count;
+    struct path_entry* entries;
+};
 
-    return NULL;
+static size_t path_hash_segment(size_t hash, const char* seg, size_t seg_len)
+{
+    uint32_t h = (uint32_t)hash;
+    h = (h ^ (uint8_t)'/') * 16777619u;
+    for (size_t i = 0; i < seg_len; i++)
+        h = (h ^ (uint8_t)seg[i]) * 16777619u;
+    return h;
 }
 
-dtb_node* dtb_find(const char* name)
+static void path_index_insert(struct path_index* index, dtb_node* node, size_t hash)
 {
-    size_t seg_len;
-    dtb_node* scan = state.root;
-    while (scan != NULL)
+    const size_t slot_mask = index->capacity - 1;
+    size_t slot = hash & slot_mask;
+    while (index->entries[slot].node != NULL)
+        slot = (slot + 1) & slot_mask;
+    index->entries[slot].hash = hash;
+    index->entries[slot].node = node;
+    index->count++;
+}
+
+/* Counts the descendants of a node, adding them to `index` if it's not NULL. Children are
+ * visited in list order, so when two nodes share a path the one dtb_find() would return is
+ * inserted (and probed) first.
+ */
+static size_t foreach_path_entry(dtb_node* node, size_t hash, struct path_index* index)
+{
+    size_t count = 0;
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
     {
-        while (name[0] == '/')
-            name++;
+        const char* name = (child->name == NULL) ? "" : child->name;
+        const size_t child_hash = path_hash_segment(hash, name, string_len(name));
+        if (index != NULL)
+            path_index_insert(index, child, child_hash);
+        count += 1 + foreach_path_entry(child, child_hash, index);
+    }
 
-        seg_len = string_find_char(name, '/');
-        if (seg_len == -1ul)
-            seg_len = string_len(name);
-        if (seg_len == 0)
-            return scan;
+    return count;
+}
 
-        scan = find_child_internal(scan, name, seg_len);
-        name += seg_len;
+/* Computes the hash the path index files a node under. Returns false if the node isn't below
+ * the root node, since only those are indexed.
+ */
+static bool node_path_hash(dtb_node* node, size_t* hash)
+{
+    if (node == state->root)
+    {
+        *hash = 2166136261u;
+        return true;
     }
+    if (node->parent == NULL || !node_path_hash(node->parent, hash))
+        return false;
 
-    return NULL;
-} 
+    const char* name = (node->name == NULL) ? "" : node->name;
+    *hash = path_hash_segment(*hash, name, string_len(name));
+    return true;
+}
 
-dtb_node* dtb_find_child(dtb_node* start, const char* name)
+/* Adds a node and its descendants to the index, returns false if they don't fit. If another
+ * node already has the same hash (usually a sibling with the same name), the new one might
+ * be probed in the wrong order, so that's treated as not fitting too.
+ */
+static bool path_index_add(struct path_index* index, dtb_node* node, size_t hash)
 {
-    if (start == NULL)
-        return NULL;
+    const size_t count = 1 + foreach_path_entry(node, hash, NULL);
+    if ((index->count + count) * 4 > index->capacity * 3)
+        return false;
 
-    return find_child_internal(start, name, string_len(name));
+    const size_t slot_mask = index->capacity - 1;
+    for (size_t slot = hash & slot_mask; index->entries[slot].node != NULL; slot = (slot + 1) & slot_mask)
+    {
+        if (index->entries[slot].hash == hash)
+            return false;
+    }
+
+    path_index_insert(index, node, hash);
+    foreach_path_entry(node, hash, index);
+    return true;
 }
 
-dtb_prop* dtb_find_prop(dtb_node* node, const char* name)
+#ifdef SMOLDTB_ENABLE_WRITE_API
+/* Removes a node and its descendants from the index, returns false if one of them is missing. */
+static bool path_index_remove(struct path_index* index, dtb_node* node, size_t hash)
 {
-    if (node == NULL)
-        return NULL;
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+    {
+        const char* name = (child->name == NULL) ? "" : child->name;
+        if (!path_index_remove(index, child, path_hash_segment(hash, name, string_len(name))))
+            return false;
+    }
 
-    const size_t name_len = string_len(name);
-    dtb_prop* prop = node->props;
-    while (prop)
+    const size_t slot_mask = index->capacity - 1;
+    size_t hole = hash & slot_mask;
+    while (index->entries[hole].node != node)
     {
-        const size_t prop_name_len = string_len(prop->name);
-        if (prop_name_len == name_len && strings_eq(prop->name, name, prop_name_len))
-            return prop;
-        prop = prop->next;
+        if (index->entries[hole].node == NULL)
+            return false;
+        hole = (hole + 1) & slot_mask;
     }
 
-    return NULL;
+    //move later entries back into the hole if that's still on their probe path
+    for (size_t next = (hole + 1) & slot_mask; index->entries[next].node != NULL; next = (next + 1) & slot_mask)
+    {
+        const size_t home = index->entries[next].hash & slot_mask;
+        if (((next - home) & slot_mask) < ((next - hole) & slot_mask))
+            continue;
+
+        index->entries[hole] = index->entries[next];
+        hole = next;
+    }
+    index->entries[hole].node = NULL;
+    index->count--;
+
+    return true;
 }
+#endif
 
-dtb_node* dtb_get_sibling(dtb_node* node)
+static struct path_index* build_path_index(dtb_ctx* ctx)
 {
-    if (node == NULL || node->sibling == NULL)
+    if (ctx->ops.malloc == NULL || ctx->ops.free == NULL)
         return NULL;
-    return node->sibling;
+
+    const size_t count = (ctx->root == NULL) ? 0 : foreach_path_entry(ctx->root, 2166136261u, NULL);
+    size_t capacity = 8;
+    while (capacity < count * 2)
+        capacity *= 2;
+
+    struct path_index* index = ctx->ops.malloc(sizeof(struct path_index) + capacity * sizeof(struct path_entry));
+    if (index == NULL)
+        return NULL;
+
+    index->capacity = capacity;
+    index->count = 0;
+    index->entries = (struct path_entry*)(index + 1);
+    for (size_t i = 0; i < capacity; i++)
+        index->entries[i].node = NULL;
+    if (ctx->root != NULL)
+        foreach_path_entry(ctx->root, 2166136261u, index);
+
+    return index;
 }
 
-dtb_node* dtb_get_child(dtb_node* node)
+static size_t path_index_bytes(struct path_index* index)
 {
-    if (node == NULL)
-        return NULL;
-    return node->child;
+    return sizeof(struct path_index) + index->capacity * sizeof(struct path_entry);
 }
 
-dtb_node* dtb_get_parent(dtb_node* node)
+/* Returns true if an earlier sibling has the same name as `node` once its unit address is
+ * left out, e.g. "memory@80000000" before "memory".
+ */
+static bool has_earlier_base_match(dtb_node* node)
 {
-    if (node == NULL)
-        return NULL;
-    return node->parent;
+    const size_t name_len = string_len(node->name);
+    for (dtb_node* scan = node->prev; scan != NULL; scan = scan->prev)
+    {
+        size_t base_len = string_find_char(scan->name, '@');
+        if (base_len == -1ul)
+            base_len = string_len(scan->name);
+        if (base_len == name_len && strings_eq(scan->name, node->name, name_len))
+            return true;
+    }
+
+    return false;
 }
 
+/* Checks the node's ancestry against the path, starting from the last segment. A segment
+ * without a unit address matches the first sibling with that base name on the linear path,
+ * so nodes shadowed like that don't match here either.
+ */
+static bool path_matches(dtb_node* root, dtb_node* node, const char* path, size_t path_len)
+{
+    size_t end = path_len;
+    while (true)
+    {
+        while (end > 0 && path[end - 1] == '/')
+            end--;
+        if (end == 0)
+            return node == root;
+        if (node == NULL || node == root)
+            return false;
+
+        size_t begin = end;
+        while (begin > 0 && path[begin - 1] != '/')
+            begin--;
 
-dtb_prop* dtb_get_prop(dtb_node* node, size_t index)
+        const char* name = (node->name == NULL) ? "" : node->name;
+        if (string_len(name) != end - begin || !strings_eq(name, path + begin, end - begin))
+            return false;
+        if (string_find_char(name, '@') == -1ul && has_earlier_base_match(node))
+            return false;
+        node = node->parent;
+        end = begin;
+    }
+}
+
+static dtb_node* find_path_indexed(struct path_index* index, dtb_node* root, const char* path)
 {
-    if (node == NULL)
-        return NULL;
-    
-    dtb_prop* prop = node->props;
-    while (prop != NULL)
+    size_t hash = 2166136261u;
+    size_t path_len = 0;
+    while (path[path_len] != 0)
     {
-        if (index == 0)
-            return prop;
+        while (path[path_len] == '/')
+            path_len++;
+
+        size_t seg_len = 0;
+        while (path[path_len + seg_len] != 0 && path[path_len + seg_len] != '/')
+            seg_len++;
+        if (seg_len != 0)
+            hash = path_hash_segment(hash, path + path_len, seg_len);
+        path_len += seg_len;
+    }
 
-        index--;
-        prop = prop->next;
+    const size_t slot_mask = index->capacity - 1;
+    for (size_t slot = hash & slot_mask; index->entries[slot].node != NULL; slot = (slot + 1) & slot_mask)
+    {
+        struct path_entry* entry = &index->entries[slot];
+        if (entry->hash == hash && path_matches(root, entry->node, path, path_len))
+            return entry->node;
     }
 
     return NULL;
 }
 
-static size_t get_cells_helper(dtb_node* node, const char* prop_name, size_t orDefault)
+/* Returns true if the caller should build an index. Only one thread builds each index,
+ * others that arrive while it's being built should use the linear path. Lookups pass `lazy`,
+ * and don't build anything if the indexes are deferred to dtb_build_indexes().
+ */
+static bool claim_index(dtb_ctx* ctx, int* index_state, bool lazy)
 {
-    if (node == NULL)
-        return orDefault;
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+    /* writers on other threads may change the tree (and free an index) while a lookup is
+     * using it, so the indexes are never built and lookups always take the linear path.
+     */
+    (void)ctx;
+    (void)index_state;
+    (void)lazy;
+    return false;
+#else
+    int expected = ATOMIC_LOAD(index_state);
+    if (expected != INDEX_NONE || (lazy && ctx->indexesDeferred))
+        return false;
+    return ATOMIC_CAS(index_state, &expected, INDEX_BUILDING);
+#endif
+}
 
-    dtb_prop* prop = dtb_find_prop(node, prop_name);
-    if (prop == NULL)
-        return orDefault;
+static struct compat_index* get_compat_index(dtb_ctx* ctx, bool lazy)
+{
+    if (claim_index(ctx, &ctx->compat_index_state, lazy))
+    {
+        ctx->compat_index = build_compat_index(ctx);
+        ATOMIC_STORE(&ctx->compat_index_state, ctx->compat_index != NULL ? INDEX_READY : INDEX_UNAVAILABLE);
+    }
 
-    uintmax_t ret_value;
-    if (dtb_read_prop_1(prop, 1, &ret_value) == 1)
-        return ret_value;
-    return orDefault;
+    return ATOMIC_LOAD(&ctx->compat_index_state) == INDEX_READY ? ctx->compat_index : NULL;
 }
 
-size_t dtb_get_addr_cells_of(dtb_node* node)
+static struct path_index* get_path_index(dtb_ctx* ctx, bool lazy)
 {
-    return get_cells_helper(node, "#address-cells", 2);
+    if (claim_index(ctx, &ctx->path_index_state, lazy))
+    {
+        ctx->path_index = build_path_index(ctx);
+        ATOMIC_STORE(&ctx->path_index_state, ctx->path_index != NULL ? INDEX_READY : INDEX_UNAVAILABLE);
+    }
+
+    return ATOMIC_LOAD(&ctx->path_index_state) == INDEX_READY ? ctx->path_index : NULL;
 }
 
-size_t dtb_get_size_cells_of(dtb_node* node)
+static void free_compat_index()
 {
-    return get_cells_helper(node, "#size-cells", 1);
+    if (state->compat_index != NULL)
+        state->ops.free(state->compat_index, compat_index_bytes(state->compat_index));
+    state->compat_index = NULL;
+    ATOMIC_STORE(&state->compat_index_state, INDEX_NONE);
 }
 
-size_t dtb_get_addr_cells_for(dtb_node* node)
+static void free_path_index()
 {
-    if (node == NULL)
-        return 2;
-    return get_cells_helper(node->parent, "#address-cells", 2);
+    if (state->path_index != NULL)
+        state->ops.free(state->path_index, path_index_bytes(state->path_index));
+    state->path_index = NULL;
+    ATOMIC_STORE(&state->path_index_state, INDEX_NONE);
 }
 
-size_t dtb_get_size_cells_for(dtb_node* node)
+/* Called when the whole tree is replaced. Modifying the tree already requires excluding
+ * readers, so the indexes can't be in use here (or in the update functions below).
+ */
+static void invalidate_indexes()
 {
-    if (node == NULL)
-        return 1;
-    return get_cells_helper(node->parent, "#size-cells", 1);
+    if (ATOMIC_LOAD(&state->compat_index_state) == INDEX_NONE
+        && ATOMIC_LOAD(&state->path_index_state) == INDEX_NONE)
+        return;
+
+    LOCK(&state->lock);
+    free_compat_index();
+    free_path_index();
+    UNLOCK(&state->lock);
 }
 
-bool dtb_is_compatible(dtb_node* node, const char* str)
+/* Returns true if an index exists and should be updated. An index that couldn't be built
+ * gets another chance once the tree has changed.
+ */
+static bool index_is_ready(int* index_state)
 {
-    if (node == NULL || str == NULL)
-        return false;
-
-    dtb_prop* compat_prop = dtb_find_prop(node, "compatible");
-    if (compat_prop == NULL)
-        return false;
+    const int current = ATOMIC_LOAD(index_state);
+    if (current == INDEX_UNAVAILABLE)
+        ATOMIC_STORE(index_state, INDEX_NONE);
+    return current == INDEX_READY;
+}
 
-    const size_t str_len = string_len(str);
-    for (size_t i = 0; ; i++)
+/* Returns true if the node can be reached from the root, rather than being unlinked (or
+ * below a node that is).
+ */
+static bool node_is_linked(dtb_node* node)
+{
+    for (; node != NULL; node = node->parent)
     {
-        const char* check_str = dtb_read_prop_string(compat_prop, i);
-        if (check_str == NULL)
+        dtb_node* head = (node->parent == NULL) ? state->root : node->parent->child;
+        if (node->prev == NULL && head != node)
             return false;
-        if (strings_eq(check_str, str, str_len))
-            return true;
     }
+
+    return true;
 }
 
-bool dtb_stat_node(dtb_node* node, dtb_node_stat* stat)
+static bool compat_index_update(struct compat_index* index, dtb_node* node, compat_action action)
 {
-    if (node == NULL || stat == NULL)
+    if (foreach_compat_string(node, index, action) == -1ul)
         return false;
-
-    stat->name = node->name;
-    if (node == state.root)
-        stat->name = ROOT_NODE_STR;
-
-    stat->prop_count = 0;
-    dtb_prop* prop = node->props;
-    while (prop != NULL)
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
     {
-        prop = prop->next;
-        stat->prop_count++;
+        if (!compat_index_update(index, child, action))
+            return false;
     }
 
-    stat->child_count = 0;
-    dtb_node* child = node->child;
-    while (child != NULL)
-    {
+    return true;
+}
+
+/* Called once a node has been linked into the tree, adds it and its descendants to the
+ * indexes. An index that runs out of room is dropped, and rebuilt by the next lookup.
+ */
+static void index_linked_node(dtb_node* node)
+{
+    const bool compat_ready = index_is_ready(&state->compat_index_state);
+    const bool path_ready = index_is_ready(&state->path_index_state);
+    if (!compat_ready && !path_ready)
+        return;
+    if (node->parent == NULL)
+    {
+        invalidate_indexes(); //the root node may have changed
+        return;
+    }
+    if (!node_is_linked(node))
+        return;
+
+    LOCK(&state->lock);
+    if (compat_ready && !compat_index_update(state->compat_index, node, compat_insert_ordered))
+        free_compat_index();
+    size_t hash;
+    if (path_ready && node_path_hash(node, &hash) && !path_index_add(state->path_index, node, hash))
+        free_path_index();
+    UNLOCK(&state->lock);
+}
+
+/* Called when the compatible strings of a linked node change: `add` is false before the old
+ * strings go away, and true once the new ones are in place.
+ */
+static void index_compat_changed(dtb_node* node, bool add)
+{
+    if (!index_is_ready(&state->compat_index_state) || !node_is_linked(node))
+        return;
+
+    LOCK(&state->lock);
+    if (foreach_compat_string(node, state->compat_index, add ? compat_insert_ordered : compat_remove) == -1ul)
+        free_compat_index();
+    UNLOCK(&state->lock);
+}
+
+#ifdef SMOLDTB_ENABLE_WRITE_API
+/* Called before a node is unlinked from the tree, removes it and its descendants from the
+ * indexes.
+ */
+static void index_unlinking_node(dtb_node* node)
+{
+    const bool compat_ready = index_is_ready(&state->compat_index_state);
+    const bool path_ready = index_is_ready(&state->path_index_state);
+    if (!compat_ready && !path_ready)
+        return;
+    if (node->parent == NULL)
+    {
+        invalidate_indexes();
+        return;
+    }
+    if (!node_is_linked(node))
+        return;
+
+    LOCK(&state->lock);
+    if (compat_ready && !compat_index_update(state->compat_index, node, compat_remove))
+        free_compat_index();
+    size_t hash;
+    if (path_ready && node_path_hash(node, &hash) && !path_index_remove(state->path_index, node, hash))
+        free_path_index();
+    UNLOCK(&state->lock);
+}
+#endif
+
+static dtb_node* find_compatible_indexed(struct compat_index* index, dtb_node* start, const char* str)
+{
+    const size_t slot = compat_key_slot(index, str, string_len(str));
+    if (index->heads[slot] == -1ul)
+        return NULL;
+
+    size_t entry = index->heads[slot];
+    if (start == NULL)
+        return index->entries[entry].node;
+
+    for (; entry != -1ul; entry = index->entries[entry].next)
+    {
+        if (index->entries[entry].node != start)
+            continue;
+
+        /* a node may list the same string twice, skip to the next node */
+        while (entry != -1ul && index->entries[entry].node == start)
+            entry = index->entries[entry].next;
+        return entry == -1ul ? NULL : index->entries[entry].node;
+    }
+
+    return start; /* start isn't compatible itself, tell the caller to search linearly */
+}
+
+/* Allocates a zeroed block that lives until the context's tree is released. The caller must
+ * hold the context's lock. */
+static void* alloc_chunk(dtb_ctx* ctx, size_t size)
+{
+    if (ctx->ops.malloc == NULL)
+        return NULL;
+
+    struct dtb_arena_chunk* chunk = ctx->ops.malloc(sizeof(struct dtb_arena_chunk) + size);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->size = sizeof(struct dtb_arena_chunk) + size;
+    chunk->next = ctx->chunks;
+    ctx->chunks = chunk;
+
+    uint8_t* buffer = (uint8_t*)(chunk + 1);
+    for (size_t i = 0; i < size; i++)
+        buffer[i] = 0;
+    return buffer;
+}
+
+/* Refs identify a node or property by a slot in the ref table, plus the generation the slot
+ * had when the ref was handed out. Slots are cleared when whatever they point to is destroyed,
+ * and generations come from one 64-bit counter shared by all contexts, so they don't repeat
+ * (it would take centuries of handing out refs to wrap) and stale refs can't resolve.
+ * Tables are never freed while the tree is alive, so readers can use an old one while a
+ * bigger one is being made. Nodes and properties remember their slot, and cleared slots are
+ * kept on a free list, so getting and clearing a ref doesn't need to search the table.
+ */
+struct dtb_ref_slot
+{
+    void* ptr;
+    uint64_t generation;
+    uint32_t next_free; /* next cleared slot plus 1, or 0 */
+    bool isProp;
+};
+
+struct dtb_ref_table
+{
+    size_t capacity;
+    size_t count;
+    size_t live_count;
+    size_t free_head; /* first cleared slot plus 1, or 0 */
+    struct dtb_ref_slot* slots;
+};
+
+static uint64_t ref_generation;
+
+static uint32_t* ref_slot_of(void* ptr, bool is_prop)
+{
+    return is_prop ? &((dtb_prop*)ptr)->ref_slot : &((dtb_node*)ptr)->ref_slot;
+}
+
+static dtb_ref get_ref(dtb_ctx* ctx, void* ptr, bool is_prop)
+{
+    dtb_ref ref;
+    ref.index = 0;
+    ref.generation = 0;
+    if (ptr == NULL)
+        return ref;
+
+    LOCK(&ctx->lock);
+    struct dtb_ref_table* table = ctx->refs;
+    uint32_t* ref_slot = ref_slot_of(ptr, is_prop);
+
+    /* the item may come from another context, in which case its slot is in that
+     * context's table, so check it's really ours before using it */
+    if (table != NULL && *ref_slot != 0 && *ref_slot <= table->count)
+    {
+        struct dtb_ref_slot* slot = &table->slots[*ref_slot - 1];
+        if (slot->generation != 0 && slot->ptr == ptr)
+        {
+            ref.index = *ref_slot - 1;
+            ref.generation = slot->generation;
+            goto done;
+        }
+    }
+
+    if (table == NULL || (table->free_head == 0 && table->count == table->capacity))
+    {
+        const size_t capacity = (table == NULL) ? 16 : table->capacity * 2;
+        struct dtb_ref_table* new_table = alloc_chunk(ctx, sizeof(struct dtb_ref_table) + capacity * sizeof(struct dtb_ref_slot));
+        if (new_table == NULL)
+        {
+            LOG_ERROR("Failed to grow ref table.");
+            goto done;
+        }
+
+        new_table->capacity = capacity;
+        new_table->count = (table == NULL) ? 0 : table->count;
+        new_table->live_count = (table == NULL) ? 0 : table->live_count;
+        new_table->free_head = (table == NULL) ? 0 : table->free_head;
+        new_table->slots = (struct dtb_ref_slot*)(new_table + 1);
+        memcpy(new_table->slots, table == NULL ? NULL : table->slots, new_table->count * sizeof(struct dtb_ref_slot));
+        ATOMIC_STORE(&ctx->refs, new_table);
+        table = new_table;
+    }
+
+    size_t index;
+    if (table->free_head != 0)
+    {
+        index = table->free_head - 1;
+        table->free_head = table->slots[index].next_free;
+    }
+    else
+        index = table->count++;
+
+    const uint64_t generation = ATOMIC_ADD(&ref_generation, 1);
+
+    table->slots[index].isProp = is_prop;
+    ATOMIC_STORE(&table->slots[index].ptr, ptr);
+    ATOMIC_STORE(&table->slots[index].generation, generation);
+    table->live_count++;
+    *ref_slot = index + 1;
+    ref.index = index;
+    ref.generation = generation;
+
+done:
+    UNLOCK(&ctx->lock);
+    return ref;
+}
+
+static void* resolve_ref(dtb_ref ref, bool is_prop)
+{
+    struct dtb_ref_table* table = ATOMIC_LOAD(&read_state()->refs);
+    if (table == NULL || ref.generation == 0 || ref.index >= table->count)
+        return NULL;
+
+    struct dtb_ref_slot* slot = &table->slots[ref.index];
+    if (ATOMIC_LOAD(&slot->generation) != ref.generation || slot->isProp != is_prop)
+        return NULL;
+
+    /* the slot could be cleared and reused while we're reading it, check it wasn't */
+    void* ptr = ATOMIC_LOAD(&slot->ptr);
+    if (ATOMIC_LOAD(&slot->generation) != ref.generation)
+        return NULL;
+    return ptr;
+}
+
+static void clear_ref(struct dtb_ref_table* table, void* ptr, bool is_prop)
+{
+    uint32_t* ref_slot = ref_slot_of(ptr, is_prop);
+    if (*ref_slot == 0 || *ref_slot > table->count)
+        return;
+
+    const size_t index = *ref_slot - 1;
+    *ref_slot = 0;
+    struct dtb_ref_slot* slot = &table->slots[index];
+    if (slot->generation == 0 || slot->ptr != ptr)
+        return;
+
+    ATOMIC_STORE(&slot->generation, 0);
+    slot->next_free = table->free_head;
+    table->free_head = index + 1;
+    table->live_count--;
+}
+
+static void clear_subtree_refs(struct dtb_ref_table* table, dtb_node* node)
+{
+    clear_ref(table, node, false);
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+        clear_ref(table, prop, true);
+    for (dtb_node* child = node->child; child != NULL && table->live_count > 0; child = child->sibling)
+        clear_subtree_refs(table, child);
+}
+
+/* Clears the refs to `prop`, or if that's NULL, to `node` and everything below it. */
+static void invalidate_refs(dtb_node* node, dtb_prop* prop)
+{
+    struct dtb_ref_table* table = state->refs;
+    if (table == NULL)
+        return;
+
+    LOCK(&state->lock);
+    if (prop != NULL)
+        clear_ref(table, prop, true);
+    else if (table->live_count > 0)
+        clear_subtree_refs(table, node);
+    UNLOCK(&state->lock);
+}
+
+static void free_buffers()
+{
+#ifdef SMOLDTB_ENABLE_WRITE_API
+    /* deferred frees may touch the arena and phandle table, so do them first */
+    discard_undo_log();
+#endif
+    invalidate_indexes();
+    if (state->handlesFromMalloc)
+        try_free(state->handle_lookup, state->handle_capacity * sizeof(struct dtb_handle_slot));
+    if (state->arenaFromMalloc)
+        try_free(state->node_buff, state->arena_size);
+    while (state->chunks != NULL)
+    {
+        struct dtb_arena_chunk* chunk = state->chunks;
+        state->chunks = chunk->next;
+        try_free(chunk, chunk->size);
+    }
+
+    state->refs = NULL;
+    state->node_buff = NULL;
+    state->prop_buff = NULL;
+    state->handle_lookup = NULL;
+    state->handle_capacity = state->handle_count = 0;
+    state->handle_max = 0;
+    state->handle_free_hint = 1;
+    state->handlesFromMalloc = false;
+    state->arena_size = 0;
+    state->arenaFromMalloc = false;
+    state->node_alloc_head = state->node_alloc_max = 0;
+    state->prop_alloc_head = state->prop_alloc_max = 0;
+}
+
+/* Counts the cells that look like tokens in [begin, end), this is done before parsing so the
+ * arena can be sized. Data cells may also look like tokens, so the counts are upper bounds.
+ */
+static void count_arena_cells(struct dtb_parse_state* parse, size_t begin, size_t end)
+{
+    const struct dtb_init_info* init_info = &parse->info;
+    for (size_t i = begin; i < end; i++)
+    {
+        if (be32(init_info->cells[i]) == FDT_BEGIN_NODE)
+            state->node_alloc_max++;
+        else if (be32(init_info->cells[i]) == FDT_PROP)
+        {
+            state->prop_alloc_max++;
+            if (i + 2 >= init_info->cell_count)
+                continue;
+
+            /* this might be a data cell that looks like a token, so check the name is sane */
+            const size_t name_offset = be32(init_info->cells[i + 2]);
+            if (name_offset < init_info->strings_size && is_phandle_name(init_info->strings + name_offset))
+                parse->handle_props++;
+        }
+    }
+}
+
+/* The arena counts are only kept if the buffers could be allocated, so a failed init leaves
+ * an empty tree behind rather than one pointing into a buffer that doesn't exist.
+ */
+static bool alloc_buffers(size_t handle_props)
+{
+    /* keep the phandle table at most half full, so probe sequences stay short */
+    size_t handle_capacity = 8;
+    while (handle_capacity < handle_props * 2)
+        handle_capacity *= 2;
+
+    size_t total_size = state->node_alloc_max * sizeof(dtb_node);
+    total_size += state->prop_alloc_max * sizeof(dtb_prop);
+    total_size += handle_capacity * sizeof(struct dtb_handle_slot);
+
+    /* Only the default context can use the static buffer, any extra contexts
+     * always get their arena from ops.malloc(). */
+    uint8_t* buffer = NULL;
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    if (state == &default_ctx)
+    {
+        if (total_size >= SMOLDTB_STATIC_BUFFER_SIZE)
+        {
+            LOG_ERROR("Too much data for statically allocated buffer.");
+            state->node_alloc_max = state->prop_alloc_max = 0;
+            return false;
+        }
+        buffer = big_buff;
+    }
+#endif
+    if (buffer == NULL)
+    {
+        buffer = try_malloc(total_size);
+        if (buffer == NULL)
+        {
+            LOG_ERROR("Failed to allocate big buffer.");
+            state->node_alloc_max = state->prop_alloc_max = 0;
+            return false;
+        }
+        state->arenaFromMalloc = true;
+    }
+    state->arena_size = total_size;
+
+    for (size_t i = 0; i < total_size; i++)
+        buffer[i] = 0;
+
+    state->node_buff = (dtb_node*)buffer;
+    state->node_alloc_head = 0;
+    state->prop_buff = (dtb_prop*)&state->node_buff[state->node_alloc_max];
+    state->prop_alloc_head = 0;
+    state->handle_lookup = (struct dtb_handle_slot*)&state->prop_buff[state->prop_alloc_max];
+    state->handle_capacity = handle_capacity;
+    state->handle_count = 0;
+    state->handle_max = 0;
+    state->handle_free_hint = 1;
+    state->handlesFromMalloc = false;
+
+    return true;
+}
+
+/* This runs on every new property found, and handles some special cases for us. */
+static void check_for_special_prop(dtb_node* node, dtb_prop* prop)
+{
+    const char name0 = prop->name[0];
+    if (name0 == 'c' && strings_eq(prop->name, "compatible", sizeof("compatible")))
+        index_compat_changed(node, true);
+    if (name0 != 'p' && name0 != 'l')
+        return; //short circuit to save processing
+
+    if (is_phandle_name(prop->name))
+        insert_phandle(read_phandle_value(prop), node);
+}
+
+static dtb_prop* parse_prop(struct dtb_init_info* init_info, size_t* offset)
+{
+    if (be32(init_info->cells[*offset]) != FDT_PROP)
+        return NULL;
+
+    (*offset)++;
+    dtb_prop* prop = alloc_prop();
+    if (prop == NULL)
+    {
+        LOG_ERROR("Property allocation failed");
+        return NULL;
+    }
+
+    const struct fdt_property* fdtprop = (struct fdt_property*)(init_info->cells + *offset);
+    prop->name = (const char*)(init_info->strings + be32(fdtprop->name_offset));
+    prop->data = (void*)(init_info->cells + *offset + 2);
+    prop->length = be32(fdtprop->length);
+    prop->fromMalloc = false;
+    prop->dataFromMalloc = false;
+    (*offset) += (dtb_align_up(be32(fdtprop->length), 4) / 4) + 2;
+    
+    return prop;
+}
+
+static dtb_node* parse_node_header(struct dtb_init_info* init_info, size_t* offset)
+{
+    dtb_node* node = alloc_node(); 
+    if (node == NULL)
+    {
+        LOG_ERROR("Node allocation failed");
+        return NULL;
+    }
+    node->name = (const char*)(init_info->cells + (*offset) + 1);
+    node->fromMalloc = false;
+
+    const size_t name_len = string_len(node->name);
+    if (name_len == 0)
+        node->name = NULL;
+    *offset += (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+
+    return node;
+}
+
+static size_t node_header_cells(const struct dtb_init_info* init_info, size_t offset)
+{
+    const char* name = (const char*)(init_info->cells + offset + 1);
+    return (dtb_align_up(string_len(name) + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+}
+
+static size_t prop_cells(const struct dtb_init_info* init_info, size_t offset)
+{
+    if (offset + 2 >= init_info->cell_count)
+        return 1;
+
+    const struct fdt_property* fdtprop = (struct fdt_property*)(init_info->cells + offset + 1);
+    return (dtb_align_up(be32(fdtprop->length), 4) / 4) + 3;
+}
+
+/* Finds a property of the node at `offset` directly in the blob. Properties come before child
+ * nodes, so only the tokens up to the first child (or the end of the node) need to be checked.
+ */
+static const char* find_raw_prop(const struct dtb_init_info* init_info, size_t offset, const char* name, size_t* length)
+{
+    const size_t name_len = string_len(name) + 1;
+    offset += node_header_cells(init_info, offset);
+    while (offset < init_info->cell_count)
+    {
+        const uint32_t test = be32(init_info->cells[offset]);
+        if (test == FDT_NOP)
+        {
+            offset++;
+            continue;
+        }
+        if (test != FDT_PROP || offset + 2 >= init_info->cell_count)
+            return NULL;
+
+        const struct fdt_property* fdtprop = (struct fdt_property*)(init_info->cells + offset + 1);
+        const size_t name_offset = be32(fdtprop->name_offset);
+        const size_t cells = prop_cells(init_info, offset);
+        if (name_offset < init_info->strings_size
+            && strings_eq(init_info->strings + name_offset, name, name_len))
+        {
+            if (offset + cells > init_info->cell_count)
+                return NULL;
+            *length = be32(fdtprop->length);
+            return (const char*)(init_info->cells + offset + 3);
+        }
+        offset += cells;
+    }
+
+    return NULL;
+}
+
+static bool node_is_disabled(const struct dtb_init_info* init_info, size_t offset)
+{
+    size_t length;
+    const char* value = find_raw_prop(init_info, offset, "status", &length);
+    return value != NULL && length >= sizeof("disabled") && strings_eq(value, "disabled", sizeof("disabled"));
+}
+
+/* How well a blob's root node matches the board, see blob_rank_better(). */
+struct blob_rank
+{
+    size_t compat;   /* index of the best matching board compatible, or -1ul */
+    size_t position; /* where that string appears in the blob's compatible list */
+    bool model;
+};
+
+static bool blob_rank_better(const struct blob_rank* a, const struct blob_rank* b)
+{
+    if (a->compat != b->compat)
+        return a->compat < b->compat;
+    if (a->position != b->position)
+        return a->position < b->position;
+    return a->model && !b->model;
+}
+
+/* Checks the header of a blob and ranks it by its root node's compatible and model properties,
+ * without parsing the rest of the tree. Returns the blob's total size, or 0 if it's not a valid
+ * blob of at most `limit` bytes.
+ */
+static size_t rank_blob(uintptr_t start, size_t limit, const char* const* compatibles, const char* model,
+    struct blob_rank* rank)
+{
+    const struct fdt_header* header = (const struct fdt_header*)start;
+    if (limit < sizeof(struct fdt_header) || be32(header->magic) != FDT_MAGIC)
+        return 0;
+
+    const size_t total_size = be32(header->total_size);
+    const size_t offset_structs = be32(header->offset_structs);
+    const size_t offset_strings = be32(header->offset_strings);
+    struct dtb_init_info info;
+    info.cell_count = be32(header->size_structs) / FDT_CELL_SIZE;
+    info.strings_size = be32(header->size_strings);
+    if (total_size > limit || offset_structs + info.cell_count * FDT_CELL_SIZE > total_size
+        || offset_strings + info.strings_size > total_size)
+        return 0;
+    info.cells = (const uint32_t*)(start + offset_structs);
+    info.strings = (const char*)(start + offset_strings);
+
+    rank->compat = -1ul;
+    rank->position = -1ul;
+    rank->model = false;
+
+    size_t offset = 0;
+    while (offset < info.cell_count && be32(info.cells[offset]) == FDT_NOP)
+        offset++;
+    if (offset >= info.cell_count || be32(info.cells[offset]) != FDT_BEGIN_NODE)
+        return total_size;
+
+    size_t length;
+    const char* value = find_raw_prop(&info, offset, "compatible", &length);
+    for (size_t position = 0, str_start = 0; value != NULL && str_start < length; position++)
+    {
+        size_t str_len = 0;
+        while (str_start + str_len < length && value[str_start + str_len] != 0)
+            str_len++;
+
+        for (size_t i = 0; compatibles != NULL && compatibles[i] != NULL && i < rank->compat; i++)
+        {
+            if (string_len(compatibles[i]) == str_len && strings_eq(value + str_start, compatibles[i], str_len))
+            {
+                rank->compat = i;
+                rank->position = position;
+                break;
+            }
+        }
+        str_start += str_len + 1;
+    }
+
+    value = find_raw_prop(&info, offset, "model", &length);
+    if (model != NULL && value != NULL)
+    {
+        const size_t model_len = string_len(model);
+        rank->model = length > model_len && value[model_len] == 0 && strings_eq(value, model, model_len);
+    }
+
+    return total_size;
+}
+
+/* Appends the name of the node at `offset` to the filter path, returns false if it's too long. */
+static bool push_filter_path(struct dtb_parse_state* parse, size_t offset)
+{
+    const char* name = (const char*)(parse->info.cells + offset + 1);
+    const size_t name_len = string_len(name);
+    const bool needs_separator = parse->path_len != 1;
+
+    if (parse->path_len == 0)
+    {
+        parse->path[parse->path_len++] = '/';
+        parse->path[parse->path_len] = 0;
+        parse->path_depth++;
+        return true;
+    }
+    if (parse->path_len + name_len + 2 > SMOLDTB_FILTER_PATH_MAX)
+        return false;
+
+    if (needs_separator)
+        parse->path[parse->path_len++] = '/';
+    memcpy(parse->path + parse->path_len, name, name_len);
+    parse->path_len += name_len;
+    parse->path[parse->path_len] = 0;
+    parse->path_depth++;
+    return true;
+}
+
+static void pop_filter_path(struct dtb_parse_state* parse)
+{
+    while (parse->path_depth > parse->depth)
+    {
+        while (parse->path_len > 1 && parse->path[parse->path_len - 1] != '/')
+            parse->path_len--;
+        if (parse->path_len > 1 || parse->path_depth == 1)
+            parse->path_len--;
+        parse->path[parse->path_len] = 0;
+        parse->path_depth--;
+    }
+}
+
+/* Decides whether the node starting at `offset` (which will be at `parse->depth + 1`) is kept.
+ * Top-level nodes always are. */
+static bool filter_keeps_node(struct dtb_parse_state* parse, size_t offset)
+{
+    const dtb_parse_filter* filter = parse->filter;
+    if (filter == NULL)
+        return true;
+    if (parse->match_depth != 0 && parse->path_depth < parse->depth)
+        return true; //this subtree's path didn't fit, so it's kept as-is
+
+    if (!push_filter_path(parse, offset))
+    {
+        LOG_ERROR("Node path is too long to filter, keeping the whole subtree.");
+        if (parse->match_depth == 0)
+            parse->match_depth = parse->depth + 1;
+        return true;
+    }
+    if (parse->depth == 0)
+        return true;
+
+    const char* name = (const char*)(parse->info.cells + offset + 1);
+    bool keep = !(filter->skip_disabled && node_is_disabled(&parse->info, offset))
+        && (filter->keep_node == NULL || filter->keep_node(parse->path, name, filter->opaque));
+
+    if (keep && filter->keep_paths != NULL && parse->match_depth == 0)
+    {
+        if (glob_list_matches(filter->keep_paths, parse->path))
+            parse->match_depth = parse->depth + 1;
+        else
+        {
+            keep = false;
+            for (size_t i = 0; filter->keep_paths[i] != NULL && !keep; i++)
+                keep = glob_matches_ancestor(filter->keep_paths[i], parse->path);
+        }
+    }
+
+    if (!keep)
+        pop_filter_path(parse);
+    return keep;
+}
+
+/* Parses the structure block, processing up to `budget` tokens. Nodes are linked into the
+ * tree as soon as they're started, closing a node pops back to its parent. When `counting`
+ * is set nothing is allocated, instead the nodes and properties that would be kept are
+ * counted so the arena can be sized. Returns false if a node couldn't be allocated.
+ */
+static bool parse_nodes(struct dtb_parse_state* parse, size_t* budget, bool counting)
+{
+    struct dtb_init_info* init_info = &parse->info;
+    for (; *budget > 0 && parse->offset < init_info->cell_count; (*budget)--)
+    {
+        const uint32_t test = be32(init_info->cells[parse->offset]);
+        if (parse->skip_depth > 0)
+        {
+            if (test == FDT_BEGIN_NODE)
+            {
+                parse->skip_depth++;
+                parse->offset += node_header_cells(init_info, parse->offset);
+            }
+            else if (test == FDT_END_NODE)
+            {
+                parse->skip_depth--;
+                parse->offset++;
+            }
+            else if (test == FDT_PROP)
+                parse->offset += prop_cells(init_info, parse->offset);
+            else
+                parse->offset++;
+        }
+        else if (test == FDT_BEGIN_NODE)
+        {
+            if (!filter_keeps_node(parse, parse->offset))
+            {
+                parse->skip_depth = 1;
+                parse->offset += node_header_cells(init_info, parse->offset);
+                continue;
+            }
+
+            parse->depth++;
+            if (counting)
+            {
+                state->node_alloc_max++;
+                parse->offset += node_header_cells(init_info, parse->offset);
+                continue;
+            }
+
+            dtb_node* node = parse_node_header(init_info, &parse->offset);
+            if (node == NULL)
+                return false;
+
+            link_node(parse->current, NULL, node);
+            parse->current = node;
+        }
+        else if (parse->depth == 0)
+            parse->offset++; //anything outside of a node is ignored
+        else if (test == FDT_END_NODE)
+        {
+            parse->offset++;
+            parse->depth--;
+            if (parse->depth < parse->match_depth)
+                parse->match_depth = 0;
+            if (parse->filter != NULL)
+                pop_filter_path(parse);
+            if (!counting)
+                parse->current = parse->current->parent;
+        }
+        else if (test == FDT_PROP && counting)
+        {
+            state->prop_alloc_max++;
+            if (parse->offset + 2 < init_info->cell_count)
+            {
+                const size_t name_offset = be32(init_info->cells[parse->offset + 2]);
+                if (name_offset < init_info->strings_size && is_phandle_name(init_info->strings + name_offset))
+                    parse->handle_props++;
+            }
+            parse->offset += prop_cells(init_info, parse->offset);
+        }
+        else if (test == FDT_PROP)
+        {
+            dtb_prop* prop = parse_prop(init_info, &parse->offset);
+            if (prop == NULL)
+                continue;
+
+            link_prop(parse->current, NULL, prop);
+            check_for_special_prop(parse->current, prop);
+        }
+        else
+            parse->offset++;
+    }
+
+    if (parse->offset < init_info->cell_count || parse->depth == 0)
+        return true;
+
+    parse->depth = parse->skip_depth = parse->match_depth = 0;
+    parse->path_depth = parse->path_len = 0;
+    if (counting)
+        return true;
+
+    /* The blob ended inside a node, drop the whole top-level tree it belongs to. It was the
+     * last one started, so it's at the head of the list. */
+    LOG_ERROR("Node is missing terminating tag.");
+    state->root = state->root->sibling;
+    if (state->root != NULL)
+        state->root->prev = NULL;
+    parse->current = NULL;
+    return true;
+}
+
+/* Starts initializing the current context, the actual work is done by init_step(). */
+static bool init_begin(uintptr_t start, dtb_ops ops, const dtb_parse_filter* filter)
+{
+    struct dtb_parse_state* parse = &state->parse;
+    parse->phase = PARSE_IDLE;
+    state->ops = ops;
+
+#if !defined(SMOLDTB_STATIC_BUFFER_SIZE)
+    if (state->ops.malloc == NULL)
+    {
+        LOG_ERROR("smoldtb has been compiled without an internal static buffer, but not passed a malloc() function.");
+        return false;
+    }
+#endif
+
+    if (start == SMOLDTB_INIT_EMPTY_TREE)
+    {
+        state->root = NULL;
+        free_buffers();
+        return true;
+    }
+
+    struct fdt_header* header = (struct fdt_header*)start;
+    if (be32(header->magic) != FDT_MAGIC)
+    {
+        LOG_ERROR("FDT has incorrect magic number.");
+        return false;
+    }
+
+    parse->info.cells = (const uint32_t*)(start + be32(header->offset_structs));
+    parse->info.cell_count = be32(header->size_structs) / sizeof(uint32_t);
+    parse->info.strings = (const char*)(start + be32(header->offset_strings));
+    parse->info.strings_size = be32(header->size_strings);
+    parse->offset = 0;
+    parse->handle_props = 0;
+    parse->current = NULL;
+    parse->depth = 0;
+    parse->filter = filter;
+    parse->skip_depth = parse->match_depth = 0;
+    parse->path_depth = parse->path_len = 0;
+    parse->phase = PARSE_SIZING;
+
+    state->root = NULL;
+    free_buffers();
+    return true;
+}
+
+static int init_step(size_t budget)
+{
+    struct dtb_parse_state* parse = &state->parse;
+    if (parse->phase == PARSE_SIZING)
+    {
+        if (parse->filter == NULL)
+        {
+            size_t count = parse->info.cell_count - parse->offset;
+            if (count > budget)
+                count = budget;
+            count_arena_cells(parse, parse->offset, parse->offset + count);
+            parse->offset += count;
+            budget -= count;
+        }
+        else
+            parse_nodes(parse, &budget, true); /* only the kept parts of the tree get space */
+        if (parse->offset < parse->info.cell_count)
+            return SMOLDTB_INIT_MORE;
+
+        if (!alloc_buffers(parse->handle_props))
+        {
+            LOG_ERROR("failed to allocate readonly buffer");
+            parse->phase = PARSE_FAILED;
+            return SMOLDTB_INIT_FAILED;
+        }
+        parse->offset = 0;
+        parse->phase = PARSE_NODES;
+    }
+
+    if (parse->phase == PARSE_NODES)
+    {
+        if (!parse_nodes(parse, &budget, false))
+        {
+            parse->phase = PARSE_FAILED;
+            return SMOLDTB_INIT_FAILED;
+        }
+        if (parse->offset < parse->info.cell_count)
+            return SMOLDTB_INIT_MORE;
+        parse->filter = NULL; /* the caller only has to keep it alive until now */
+        parse->phase = PARSE_IDLE;
+    }
+
+    return parse->phase == PARSE_FAILED ? SMOLDTB_INIT_FAILED : SMOLDTB_INIT_DONE;
+}
+
+/* Incremental reparsing walks the new blob alongside the existing tree. Nodes and properties
+ * with matching names are reused (so handles to them stay valid) and pointed at the new blob,
+ * anything else is allocated from a chunk. The first pass only counts what's needed, so
+ * the tree isn't touched unless the blob is well-formed and everything could be allocated.
+ * Both passes match items by name, so the counts are exact and the chunk (which starts
+ * zeroed) always has room. The caller's filter (if any) is applied to the new blob as well.
+ */
+struct reparse_data
+{
+    const struct dtb_init_info* info;
+    bool counting;
+    size_t nodes;
+    size_t props;
+    size_t handle_props;
+    dtb_node* node_arena;
+    dtb_prop* prop_arena;
+    struct dtb_parse_state filter;
+};
+
+/* While counting, matched items are marked by pointing their parent here (instead of being
+ * removed from their list), and the marks are cleared once their parent has been walked. */
+static dtb_node reparse_taken;
+
+static dtb_node* alloc_reparse_node(struct reparse_data* data)
+{
+    if (data->nodes == 0)
+        return NULL;
+
+    data->nodes--;
+    return data->node_arena++;
+}
+
+static dtb_prop* alloc_reparse_prop(struct reparse_data* data)
+{
+    if (data->props == 0)
+        return NULL;
+
+    data->props--;
+    return data->prop_arena++;
+}
+
+static bool reparse_names_eq(const char* existing, const char* name, size_t name_len)
+{
+    if (existing == NULL)
+        return name_len == 0;
+    return string_len(existing) == name_len && strings_eq(existing, name, name_len);
+}
+
+/* Finds an unmatched node called `name`, searching outwards in both directions from the
+ * previous match (`cursor`, or the head of the list to begin with). Blobs usually keep their
+ * nodes in the same order, and the existing lists are in either that order or its reverse
+ * (nodes are prepended as they're parsed), so the next match is normally a neighbour of the
+ * last one and matching a whole list is linear. Matched nodes are unlinked from the list
+ * (keeping the prev pointers intact) unless we're counting.
+ */
+static dtb_node* take_reparse_node(struct reparse_data* data, dtb_node** list, dtb_node** cursor, const char* name, size_t name_len)
+{
+    dtb_node* fwd = (*cursor == NULL) ? *list : *cursor;
+    dtb_node* back = (fwd == NULL) ? NULL : fwd->prev;
+    dtb_node* node = NULL;
+    while (node == NULL && (fwd != NULL || back != NULL))
+    {
+        if (fwd != NULL)
+        {
+            if (fwd->parent != &reparse_taken && reparse_names_eq(fwd->name, name, name_len))
+                node = fwd;
+            fwd = fwd->sibling;
+        }
+        if (node == NULL && back != NULL)
+        {
+            if (back->parent != &reparse_taken && reparse_names_eq(back->name, name, name_len))
+                node = back;
+            back = back->prev;
+        }
+    }
+    if (node == NULL)
+        return NULL;
+
+    if (data->counting)
+    {
+        node->parent = &reparse_taken;
+        *cursor = node;
+        return node;
+    }
+
+    *cursor = (node->prev != NULL) ? node->prev : node->sibling;
+    if (node->prev != NULL)
+        node->prev->sibling = node->sibling;
+    else
+        *list = node->sibling;
+    if (node->sibling != NULL)
+        node->sibling->prev = node->prev;
+    return node;
+}
+
+/* Same as take_reparse_node(), but for properties. */
+static dtb_prop* take_reparse_prop(struct reparse_data* data, dtb_prop** list, dtb_prop** cursor, const char* name)
+{
+    const size_t name_len = string_len(name) + 1;
+    dtb_prop* fwd = (*cursor == NULL) ? *list : *cursor;
+    dtb_prop* back = (fwd == NULL) ? NULL : fwd->prev;
+    dtb_prop* prop = NULL;
+    while (prop == NULL && (fwd != NULL || back != NULL))
+    {
+        if (fwd != NULL)
+        {
+            if (fwd->node != &reparse_taken && strings_eq(fwd->name, name, name_len))
+                prop = fwd;
+            fwd = fwd->next;
+        }
+        if (prop == NULL && back != NULL)
+        {
+            if (back->node != &reparse_taken && strings_eq(back->name, name, name_len))
+                prop = back;
+            back = back->prev;
+        }
+    }
+    if (prop == NULL)
+        return NULL;
+
+    if (data->counting)
+    {
+        prop->node = &reparse_taken;
+        *cursor = prop;
+        return prop;
+    }
+
+    *cursor = (prop->prev != NULL) ? prop->prev : prop->next;
+    if (prop->prev != NULL)
+        prop->prev->next = prop->next;
+    else
+        *list = prop->next;
+    if (prop->next != NULL)
+        prop->next->prev = prop->prev;
+    return prop;
+}
+
+static void update_reparse_prop(dtb_prop* prop, const char* name, const void* prop_data, size_t length)
+{
+    if (!prop->fromMalloc)
+        prop->name = name;
+
+    if (prop->length == length && memory_eq(prop->data, prop_data, length))
+    {
+        if (!prop->dataFromMalloc)
+            prop->data = (void*)prop_data;
+        return;
+    }
+
+#ifdef SMOLDTB_ENABLE_WRITE_API
+    if (prop->dataFromMalloc)
+        try_free(prop->data, prop->length);
+#endif
+    prop->data = (void*)prop_data;
+    prop->length = length;
+    prop->dataFromMalloc = false;
+}
+
+/* Applies the original parse filter to the node at `offset`, see filter_keeps_node(). */
+static bool reparse_keeps_node(struct reparse_data* data, size_t offset)
+{
+    struct dtb_parse_state* filter = &data->filter;
+    if (filter->filter == NULL)
+        return true;
+    if (!filter_keeps_node(filter, offset))
+        return false;
+
+    filter->depth++;
+    return true;
+}
+
+static void reparse_close_node(struct reparse_data* data)
+{
+    struct dtb_parse_state* filter = &data->filter;
+    if (filter->filter == NULL)
+        return;
+
+    filter->depth--;
+    if (filter->depth < filter->match_depth)
+        filter->match_depth = 0;
+    pop_filter_path(filter);
+}
+
+/* Moves `offset` past a node that was filtered out. Returns false if the blob ends first. */
+static bool skip_reparse_node(const struct dtb_init_info* info, size_t* offset)
+{
+    size_t depth = 0;
+    while (*offset < info->cell_count)
+    {
+        const uint32_t test = be32(info->cells[*offset]);
+        if (test == FDT_BEGIN_NODE)
+        {
+            depth++;
+            *offset += node_header_cells(info, *offset);
+        }
+        else if (test == FDT_END_NODE)
+        {
+            (*offset)++;
+            if (--depth == 0)
+                return true;
+        }
+        else if (test == FDT_PROP)
+            *offset += prop_cells(info, *offset);
+        else
+            (*offset)++;
+    }
+
+    return false;
+}
+
+/* Walks the node starting at `offset` in the new blob, which corresponds to `node` in the
+ * existing tree (NULL if it's new, only while counting). Returns false if the blob ends
+ * before the node does.
+ */
+static bool reparse_node(struct reparse_data* data, dtb_node* node, size_t* offset)
+{
+    const struct dtb_init_info* info = data->info;
+    const char* name = (const char*)(info->cells + *offset + 1);
+    const size_t name_len = string_len(name);
+    *offset += node_header_cells(info, *offset);
+
+    dtb_prop* old_props = NULL;
+    dtb_node* old_children = NULL;
+    if (node != NULL)
+    {
+        old_props = node->props;
+        old_children = node->child;
+    }
+    dtb_prop* prop_cursor = NULL;
+    dtb_node* child_cursor = NULL;
+    if (!data->counting)
+    {
+        if (!node->fromMalloc)
+            node->name = (name_len == 0) ? NULL : name;
+        node->props = NULL;
+        node->child = NULL;
+    }
+
+    bool closed = false;
+    bool success = true;
+    while (*offset < info->cell_count && !closed && success)
+    {
+        const uint32_t test = be32(info->cells[*offset]);
+        if (test == FDT_END_NODE)
+        {
+            (*offset)++;
+            closed = true;
+        }
+        else if (test == FDT_PROP)
+        {
+            if (*offset + 2 >= info->cell_count)
+            {
+                success = false;
+                break;
+            }
+
+            const struct fdt_property* fdtprop = (struct fdt_property*)(info->cells + *offset + 1);
+            const char* prop_name = info->strings + be32(fdtprop->name_offset);
+            const void* prop_data = info->cells + *offset + 3;
+            const size_t length = be32(fdtprop->length);
+            *offset += prop_cells(info, *offset);
+
+            dtb_prop* prop = take_reparse_prop(data, &old_props, &prop_cursor, prop_name);
+            if (data->counting)
+            {
+                if (prop == NULL)
+                    data->props++;
+                if (is_phandle_name(prop_name))
+                    data->handle_props++;
+                continue;
+            }
+
+            if (prop == NULL)
+            {
+                prop = alloc_reparse_prop(data);
+                prop->name = prop_name;
+            }
+            update_reparse_prop(prop, prop_name, prop_data, length);
+            link_prop(node, NULL, prop);
+        }
+        else if (test == FDT_BEGIN_NODE)
+        {
+            if (!reparse_keeps_node(data, *offset))
+            {
+                success = skip_reparse_node(info, offset);
+                continue;
+            }
+
+            const char* child_name = (const char*)(info->cells + *offset + 1);
+            dtb_node* child = take_reparse_node(data, &old_children, &child_cursor, child_name, string_len(child_name));
+            if (data->counting && child == NULL)
+                data->nodes++;
+            if (!data->counting)
+            {
+                if (child == NULL)
+                    child = alloc_reparse_node(data);
+                link_node(node, NULL, child);
+            }
+
+            success = reparse_node(data, child, offset);
+            reparse_close_node(data);
+        }
+        else
+            (*offset)++;
+    }
+
+    if (data->counting)
+    {
+        /* clear the marks left by take_reparse_*() */
+        for (dtb_prop* prop = old_props; prop != NULL; prop = prop->next)
+            prop->node = node;
+        for (dtb_node* child = old_children; child != NULL; child = child->sibling)
+            child->parent = node;
+        return success && closed;
+    }
+
+    /* whatever is left no longer exists in the new blob */
+    while (old_props != NULL)
+    {
+        dtb_prop* prop = old_props;
+        old_props = prop->next;
+        invalidate_refs(node, prop);
+#ifdef SMOLDTB_ENABLE_WRITE_API
+        destroy_props(node, prop, NULL);
+#endif
+    }
+    while (old_children != NULL)
+    {
+        dtb_node* child = old_children;
+        old_children = child->sibling;
+        invalidate_refs(child, NULL);
+        child->parent = NULL;
+#ifdef SMOLDTB_ENABLE_WRITE_API
+        destroy_dead_node(child);
+#endif
+    }
+    return success && closed;
+}
+
+/* Walks the top-level nodes of the new blob, matching them against the existing ones. */
+static bool reparse_tree(struct reparse_data* data)
+{
+    const struct dtb_init_info* info = data->info;
+    dtb_node* old_roots = state->root;
+    dtb_node* cursor = NULL;
+    if (!data->counting)
+        state->root = NULL;
+
+    struct dtb_parse_state* filter = &data->filter;
+    filter->depth = filter->skip_depth = filter->match_depth = 0;
+    filter->path_depth = filter->path_len = 0;
+
+    bool success = true;
+    for (size_t offset = 0; offset < info->cell_count && success;)
+    {
+        if (be32(info->cells[offset]) != FDT_BEGIN_NODE)
+        {
+            offset++;
+            continue;
+        }
+
+        reparse_keeps_node(data, offset); /* top-level nodes are always kept */
+        const char* name = (const char*)(info->cells + offset + 1);
+        dtb_node* node = take_reparse_node(data, &old_roots, &cursor, name, string_len(name));
+        if (data->counting && node == NULL)
+            data->nodes++;
+        if (!data->counting)
+        {
+            if (node == NULL)
+                node = alloc_reparse_node(data);
+            link_node(NULL, NULL, node);
+        }
+
+        success = reparse_node(data, node, &offset);
+        reparse_close_node(data);
+    }
+
+    if (data->counting)
+    {
+        for (dtb_node* node = old_roots; node != NULL; node = node->sibling)
+            node->parent = NULL;
+        return success;
+    }
+
+    while (old_roots != NULL)
+    {
+        dtb_node* node = old_roots;
+        old_roots = node->sibling;
+        invalidate_refs(node, NULL);
+#ifdef SMOLDTB_ENABLE_WRITE_API
+        destroy_dead_node(node);
+#endif
+    }
+    return success;
+}
+
+/* Phandles may have moved, appeared or disappeared anywhere in the tree. */
+static void rebuild_phandles()
+{
+    LOCK(&state->lock);
+    for (size_t i = 0; i < state->handle_capacity; i++)
+        state->handle_lookup[i].node = NULL;
+    state->handle_count = 0;
+    state->handle_max = 0;
+    state->handle_free_hint = 1;
+    UNLOCK(&state->lock);
+
+    for (dtb_node* scan = state->root; scan != NULL; scan = next_node_preorder(scan))
+    {
+        for (dtb_prop* prop = scan->props; prop != NULL; prop = prop->next)
+        {
+            if (is_phandle_name(prop->name))
+                insert_phandle(read_phandle_value(prop), scan);
+        }
+    }
+}
+
+static size_t get_cells_helper(dtb_node* node, const char* prop_name, size_t orDefault);
+
+/* Properties that contain phandle references, and the name of the property in the
+ * referenced node which says how many argument cells follow each phandle. A NULL cells
+ * name means the property is a plain list of phandles.
+ */
+struct phandle_ref_desc
+{
+    const char* prop_name;
+    const char* cells_name;
+    size_t default_cells; /* used if the provider doesn't have the cells property */
+};
+
+#define NO_DEFAULT_CELLS ((size_t)-1)
+
+static const struct phandle_ref_desc phandle_ref_props[] =
+{
+    { "interrupt-parent", NULL, 0 },
+    { "interrupts-extended", "#interrupt-cells", NO_DEFAULT_CELLS },
+    { "clocks", "#clock-cells", NO_DEFAULT_CELLS },
+    { "resets", "#reset-cells", NO_DEFAULT_CELLS },
+    { "dmas", "#dma-cells", NO_DEFAULT_CELLS },
+    { "phys", "#phy-cells", NO_DEFAULT_CELLS },
+    { "power-domains", "#power-domain-cells", NO_DEFAULT_CELLS },
+    { "iommus", "#iommu-cells", NO_DEFAULT_CELLS },
+    { "mboxes", "#mbox-cells", NO_DEFAULT_CELLS },
+    { "pwms", "#pwm-cells", NO_DEFAULT_CELLS },
+    { "io-channels", "#io-channel-cells", NO_DEFAULT_CELLS },
+    { "thermal-sensors", "#thermal-sensor-cells", NO_DEFAULT_CELLS },
+    { "msi-parent", "#msi-cells", 0 },
+    { "interconnects", "#interconnect-cells", NO_DEFAULT_CELLS },
+    { "regmap", NULL, 0 },
+    { "syscon", NULL, 0 },
+    { "memory-region", NULL, 0 },
+};
+
+static const struct phandle_ref_desc gpio_ref_desc = { "gpios", "#gpio-cells", NO_DEFAULT_CELLS };
+static const struct phandle_ref_desc pinctrl_ref_desc = { "pinctrl-", NULL, 0 };
+
+/* A single reference found inside a property. If the provider couldn't be found, or
+ * it doesn't say how many argument cells it takes, the rest of the property can't be
+ * decoded and `arg_cells` is set to -1.
+ */
+struct phandle_ref
+{
+    dtb_prop* prop;
+    uint32_t handle;
+    dtb_node* provider;
+    size_t arg_cells;
+    bool truncated;
+};
+
+static const struct phandle_ref_desc* find_phandle_ref_desc(const char* name)
+{
+    const size_t name_len = string_len(name);
+    for (size_t i = 0; i < sizeof(phandle_ref_props) / sizeof(phandle_ref_props[0]); i++)
+    {
+        const size_t desc_len = string_len(phandle_ref_props[i].prop_name);
+        if (name_len == desc_len && strings_eq(name, phandle_ref_props[i].prop_name, name_len))
+            return &phandle_ref_props[i];
+    }
+
+    /* "gpios" and "<name>-gpios", but not things like "ngpios" */
+    const size_t gpio_len = 5;
+    if (name_len >= gpio_len && strings_eq(name + name_len - gpio_len, "gpios", gpio_len)
+        && (name_len == gpio_len || name[name_len - gpio_len - 1] == '-'))
+        return &gpio_ref_desc;
+
+    /* pinctrl-0, pinctrl-1 etc, but not pinctrl-names */
+    const size_t pinctrl_len = 8;
+    if (name_len > pinctrl_len && strings_eq(name, "pinctrl-", pinctrl_len)
+        && name[pinctrl_len] >= '0' && name[pinctrl_len] <= '9')
+        return &pinctrl_ref_desc;
+
+    return NULL;
+}
+
+/* Decodes each phandle reference in a property. Returns false if the callback aborted. */
+static bool foreach_phandle_ref(dtb_prop* prop, const struct phandle_ref_desc* desc, bool (*action)(const struct phandle_ref* ref, void* opaque), void* opaque)
+{
+    const uint32_t* cells = prop->data;
+    const size_t cell_count = prop->length / FDT_CELL_SIZE;
+
+    size_t i = 0;
+    while (i < cell_count)
+    {
+        struct phandle_ref ref;
+        ref.prop = prop;
+        ref.handle = be32(cells[i]);
+        ref.provider = dtb_find_phandle(ref.handle);
+        ref.truncated = false;
+
+        if (desc->cells_name == NULL)
+            ref.arg_cells = 0;
+        else if (ref.provider == NULL)
+            ref.arg_cells = -1ul;
+        else
+        {
+            ref.arg_cells = get_cells_helper(ref.provider, desc->cells_name, desc->default_cells);
+            if (ref.arg_cells != -1ul && i + 1 + ref.arg_cells > cell_count)
+                ref.truncated = true;
+        }
+
+        if (!action(&ref, opaque))
+            return false;
+        if (ref.arg_cells == -1ul || ref.truncated)
+            return true;
+        i += 1 + ref.arg_cells;
+    }
+
+    return true;
+}
+
+/* Nodes with an 'interrupts' property use the closest 'interrupt-parent', which may be
+ * inherited from an ancestor. */
+static dtb_node* find_interrupt_parent(dtb_node* node)
+{
+    for (dtb_node* scan = node; scan != NULL; scan = scan->parent)
+    {
+        dtb_prop* prop = dtb_find_prop(scan, "interrupt-parent");
+        if (prop != NULL)
+            return dtb_find_phandle(read_phandle_value(prop));
+    }
+
+    return NULL;
+}
+
+/* ---- Section: Readonly-Mode Public API ---- */
+
+size_t dtb_query_total_size(uintptr_t fdt_start)
+{
+    if (fdt_start == 0)
+        return 0;
+
+    struct fdt_header* header = (struct fdt_header*)fdt_start;
+    if (be32(header->magic) != FDT_MAGIC)
+        return 0;
+
+    return be32(header->total_size);
+}
+
+/* Blobs are usually concatenated back to back, but allow padding up to an 8 byte boundary. */
+static size_t next_concatenated_blob(uintptr_t start, size_t length, size_t offset)
+{
+    for (size_t align = FDT_CELL_SIZE; align <= 8; align *= 2)
+    {
+        const size_t next = dtb_align_up(offset, align);
+        if (next + sizeof(struct fdt_header) <= length
+            && be32(((const struct fdt_header*)(start + next))->magic) == FDT_MAGIC)
+            return next;
+    }
+
+    return length;
+}
+
+uintptr_t dtb_select_concatenated(uintptr_t start, size_t length, const char* const* compatibles, const char* model)
+{
+    if (start == 0)
+        return 0;
+
+    uintptr_t best = 0;
+    struct blob_rank best_rank = { 0 };
+    size_t offset = 0;
+    while (offset < length)
+    {
+        struct blob_rank rank;
+        const size_t size = rank_blob(start + offset, length - offset, compatibles, model, &rank);
+        if (size == 0)
+            break;
+
+        if ((rank.compat != -1ul || rank.model) && (best == 0 || blob_rank_better(&rank, &best_rank)))
+        {
+            best = start + offset;
+            best_rank = rank;
+        }
+        offset = next_concatenated_blob(start, length, offset + size);
+    }
+
+    return best;
+}
+
+uintptr_t dtb_select_from_table(const uintptr_t* blobs, size_t count, const char* const* compatibles, const char* model)
+{
+    if (blobs == NULL)
+        return 0;
+
+    uintptr_t best = 0;
+    struct blob_rank best_rank = { 0 };
+    for (size_t i = 0; i < count; i++)
+    {
+        struct blob_rank rank;
+        if (blobs[i] == 0 || rank_blob(blobs[i], -1ul, compatibles, model, &rank) == 0)
+            continue;
+
+        if ((rank.compat != -1ul || rank.model) && (best == 0 || blob_rank_better(&rank, &best_rank)))
+        {
+            best = blobs[i];
+            best_rank = rank;
+        }
+    }
+
+    return best;
+}
+
+bool smoldtb_init(uintptr_t start, dtb_ops ops)
+{
+    return smoldtb_init_filtered(start, ops, NULL);
+}
+
+bool smoldtb_init_filtered(uintptr_t start, dtb_ops ops, const dtb_parse_filter* filter)
+{
+    if (!init_begin(start, ops, filter))
+        return false;
+
+    return init_step(-1ul) == SMOLDTB_INIT_DONE;
+}
+
+bool dtb_init_begin(dtb_ctx* ctx, uintptr_t start, dtb_ops ops, const dtb_parse_filter* filter)
+{
+    dtb_ctx* prev = swap_state((ctx == NULL) ? state : ctx);
+    const bool success = init_begin(start, ops, filter);
+    swap_state(prev);
+
+    return success;
+}
+
+int dtb_init_step(dtb_ctx* ctx, size_t budget)
+{
+    if (budget == 0)
+        budget = 1;
+
+    dtb_ctx* prev = swap_state((ctx == NULL) ? state : ctx);
+    const int result = init_step(budget);
+    swap_state(prev);
+
+    return result;
+}
+
+bool smoldtb_reinit_incremental(uintptr_t start, const dtb_parse_filter* filter)
+{
+    struct fdt_header* header = (struct fdt_header*)start;
+    if (start == 0 || be32(header->magic) != FDT_MAGIC)
+    {
+        LOG_ERROR("FDT has incorrect magic number.");
+        return false;
+    }
+    if (state->parse.phase != PARSE_IDLE)
+    {
+        LOG_ERROR("Cannot reparse until the previous init has completed.");
+        return false;
+    }
+#ifdef SMOLDTB_ENABLE_WRITE_API
+    if (is_logging_undo())
+    {
+        LOG_ERROR("Cannot reparse while a snapshot is open.");
+        return false;
+    }
+#endif
+
+    struct dtb_init_info info;
+    info.cells = (const uint32_t*)(start + be32(header->offset_structs));
+    info.cell_count = be32(header->size_structs) / sizeof(uint32_t);
+    info.strings = (const char*)(start + be32(header->offset_strings));
+    info.strings_size = be32(header->size_strings);
+
+    struct reparse_data data;
+    data.info = &info;
+    data.counting = true;
+    data.nodes = data.props = data.handle_props = 0;
+    data.filter.info = info;
+    data.filter.filter = filter;
+    if (!reparse_tree(&data))
+    {
+        LOG_ERROR("Node is missing terminating tag.");
+        return false;
+    }
+
+    /* everything is allocated up front, so failing can't leave the tree half-updated */
+    LOCK(&state->lock);
+    bool handles_fit = true;
+    while (handles_fit && data.handle_props * 2 > state->handle_capacity)
+        handles_fit = grow_phandle_table();
+    UNLOCK(&state->lock);
+    if (!handles_fit)
+        return false;
+
+    data.node_arena = NULL;
+    data.prop_arena = NULL;
+    if (data.nodes + data.props > 0)
+    {
+        LOCK(&state->lock);
+        data.node_arena = alloc_chunk(state, data.nodes * sizeof(dtb_node) + data.props * sizeof(dtb_prop));
+        UNLOCK(&state->lock);
+        if (data.node_arena == NULL)
+        {
+            LOG_ERROR("Failed to allocate arena for reparse.");
+            return false;
+        }
+        data.prop_arena = (dtb_prop*)(data.node_arena + data.nodes);
+    }
+
+    /* most of the tree moves around, so rebuilding the indexes is cheaper than updating them */
+    invalidate_indexes();
+    data.counting = false;
+    reparse_tree(&data);
+    rebuild_phandles();
+    return true;
+}
+
+dtb_ctx* dtb_ctx_create(dtb_ops ops)
+{
+    if (ops.malloc == NULL)
+        return NULL;
+
+    dtb_ctx* ctx = ops.malloc(sizeof(dtb_ctx));
+    if (ctx == NULL)
+        return NULL;
+
+    uint8_t* raw = (uint8_t*)ctx;
+    for (size_t i = 0; i < sizeof(dtb_ctx); i++)
+        raw[i] = 0;
+    ctx->ops = ops;
+
+    return ctx;
+}
+
+void dtb_ctx_destroy(dtb_ctx* ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    dtb_ctx* prev = swap_state(ctx);
+    if (prev == ctx)
+        prev = &default_ctx;
+#ifdef SMOLDTB_ENABLE_WRITE_API
+    while (state->root != NULL)
+    {
+        dtb_node* deletee = state->root;
+        state->root = deletee->sibling;
+        destroy_dead_node(deletee);
+    }
+#endif
+    free_buffers();
+    swap_state(prev);
+    if (published == ctx)
+        publish_state(prev);
+
+    /* the default context isn't allocated, so destroying it only releases its tree */
+    if (ctx != &default_ctx && ctx->ops.free != NULL)
+        ctx->ops.free(ctx, sizeof(dtb_ctx));
+}
+
+dtb_ctx* dtb_ctx_select(dtb_ctx* ctx)
+{
+    dtb_ctx* prev = swap_state((ctx == NULL) ? &default_ctx : ctx);
+    publish_state(state);
+    return prev;
+}
+
+bool smoldtb_reinit_atomic(uintptr_t start, dtb_ops ops, void (*retire)(dtb_ctx* old, void* opaque), void* opaque)
+{
+    if (retire == NULL)
+        return false;
+
+    dtb_ctx* ctx = dtb_ctx_create(ops);
+    if (ctx == NULL)
+    {
+        LOG_ERROR("Failed to allocate context for reinit.");
+        return false;
+    }
+
+    /* Build the new tree without publishing it, readers keep using the old one. */
+    dtb_ctx* old = swap_state(ctx);
+    ctx->indexesDeferred = old->indexesDeferred;
+    if (!smoldtb_init(start, ops))
+    {
+        swap_state(old);
+        dtb_ctx_destroy(ctx);
+        return false;
+    }
+
+    /* After this, new readers will only see the new tree. Readers that started before may
+     * still be using the old one, so it's up to the caller to free it after a grace period.
+     */
+    publish_state(ctx);
+    retire(old, opaque);
+    return true;
+}
+
+dtb_ctx* dtb_ctx_current()
+{
+    return state;
+}
+
+void dtb_defer_indexes(dtb_ctx* ctx, bool defer)
+{
+    if (ctx == NULL)
+        ctx = read_state();
+    ctx->indexesDeferred = defer;
+}
+
+bool dtb_build_indexes(dtb_ctx* ctx)
+{
+    if (ctx == NULL)
+        ctx = read_state();
+
+    /* each index is published as soon as it's ready, lookups that use it don't need to wait
+     * for the others. */
+    const bool have_paths = get_path_index(ctx, false) != NULL;
+    const bool have_compat = get_compat_index(ctx, false) != NULL;
+    return have_paths && have_compat;
+}
+
+dtb_node* dtb_find_compatible(dtb_node* start, const char* str)
+{
+    if (str == NULL)
+        return NULL;
+
+    dtb_ctx* ctx = read_state();
+    struct compat_index* index = get_compat_index(ctx, true);
+    if (index != NULL)
+    {
+        dtb_node* found = find_compatible_indexed(index, start, str);
+        if (found != start || start == NULL)
+            return found;
+    }
+
+    dtb_node* scan = ctx->root;
+    if (start != NULL)
+        scan = next_node_preorder(start); //we want to start searching AFTER this node.
+
+    for (; scan != NULL; scan = next_node_preorder(scan))
+    {
+        if (dtb_is_compatible(scan, str))
+            return scan;
+    }
+
+    return NULL;
+} 
+
+dtb_ref dtb_get_node_ref(dtb_node* node)
+{
+    return get_ref(read_state(), node, false);
+}
+
+dtb_ref dtb_get_prop_ref(dtb_prop* prop)
+{
+    return get_ref(read_state(), prop, true);
+}
+
+dtb_node* dtb_resolve_node(dtb_ref ref)
+{
+    return resolve_ref(ref, false);
+}
+
+dtb_prop* dtb_resolve_prop(dtb_ref ref)
+{
+    return resolve_ref(ref, true);
+}
+
+dtb_node* dtb_find_phandle(unsigned handle)
+{
+    /* only read the context once, in case a new tree is published while we're searching */
+    struct dtb_handle_slot* slot = find_phandle_slot(read_state(), handle);
+    if (slot != NULL)
+        return slot->node;
+
+    return NULL;
+}
+
+static dtb_node* find_child_internal(dtb_node* start, const char* name, size_t name_bounds)
+{
+    /* if the caller provided a unit address we compare the full name, otherwise it's ignored */
+    const size_t at_pos = string_find_char(name, '@');
+    const bool has_addr = at_pos < name_bounds;
+
+    dtb_node* scan = start->child;
+    while (scan != NULL)
+    {
+        size_t child_name_len = string_find_char(scan->name, '@');
+        if (child_name_len == -1ul || has_addr)
+            child_name_len = string_len(scan->name);
+
+        if (child_name_len == name_bounds && strings_eq(scan->name, name, name_bounds))
+            return scan;
+
+        scan = scan->sibling;
+    }
+
+    return NULL;
+}
+
+static dtb_node* find_path_from(dtb_node* scan, const char* name)
+{
+    size_t seg_len;
+    while (scan != NULL)
+    {
+        while (name[0] == '/')
+            name++;
+
+        seg_len = string_find_char(name, '/');
+        if (seg_len == -1ul)
+            seg_len = string_len(name);
+        if (seg_len == 0)
+            return scan;
+
+        scan = find_child_internal(scan, name, seg_len);
+        name += seg_len;
+    }
+
+    return NULL;
+}
+
+dtb_node* dtb_find(const char* name)
+{
+    dtb_ctx* ctx = read_state();
+    struct path_index* index = get_path_index(ctx, true);
+    if (index != NULL)
+    {
+        dtb_node* found = find_path_indexed(index, ctx->root, name);
+        if (found != NULL)
+            return found;
+    }
+
+    return find_path_from(ctx->root, name);
+}
+
+dtb_node* dtb_find_child(dtb_node* start, const char* name)
+{
+    if (start == NULL)
+        return NULL;
+
+    return find_child_internal(start, name, string_len(name));
+}
+
+dtb_prop* dtb_find_prop(dtb_node* node, const char* name)
+{
+    if (node == NULL)
+        return NULL;
+
+    const size_t name_len = string_len(name);
+    dtb_prop* prop = node->props;
+    while (prop)
+    {
+        const size_t prop_name_len = string_len(prop->name);
+        if (prop_name_len == name_len && strings_eq(prop->name, name, prop_name_len))
+            return prop;
+        prop = prop->next;
+    }
+
+    return NULL;
+}
+
+dtb_node* dtb_get_sibling(dtb_node* node)
+{
+    if (node == NULL || node->sibling == NULL)
+        return NULL;
+    return node->sibling;
+}
+
+dtb_node* dtb_get_prev_sibling(dtb_node* node)
+{
+    if (node == NULL)
+        return NULL;
+    return node->prev;
+}
+
+dtb_node* dtb_get_child(dtb_node* node)
+{
+    if (node == NULL)
+        return NULL;
+    return node->child;
+}
+
+dtb_node* dtb_get_parent(dtb_node* node)
+{
+    if (node == NULL)
+        return NULL;
+    return node->parent;
+}
+
+
+dtb_prop* dtb_get_prop(dtb_node* node, size_t index)
+{
+    if (node == NULL)
+        return NULL;
+    
+    dtb_prop* prop = node->props;
+    while (prop != NULL)
+    {
+        if (index == 0)
+            return prop;
+
+        index--;
+        prop = prop->next;
+    }
+
+    return NULL;
+}
+
+static size_t get_cells_helper(dtb_node* node, const char* prop_name, size_t orDefault)
+{
+    if (node == NULL)
+        return orDefault;
+
+    dtb_prop* prop = dtb_find_prop(node, prop_name);
+    if (prop == NULL)
+        return orDefault;
+
+    uintmax_t ret_value;
+    if (dtb_read_prop_1(prop, 1, &ret_value) == 1)
+        return ret_value;
+    return orDefault;
+}
+
+size_t dtb_get_addr_cells_of(dtb_node* node)
+{
+    return get_cells_helper(node, "#address-cells", 2);
+}
+
+size_t dtb_get_size_cells_of(dtb_node* node)
+{
+    return get_cells_helper(node, "#size-cells", 1);
+}
+
+size_t dtb_get_addr_cells_for(dtb_node* node)
+{
+    if (node == NULL)
+        return 2;
+    return get_cells_helper(node->parent, "#address-cells", 2);
+}
+
+size_t dtb_get_size_cells_for(dtb_node* node)
+{
+    if (node == NULL)
+        return 1;
+    return get_cells_helper(node->parent, "#size-cells", 1);
+}
+
+bool dtb_is_compatible(dtb_node* node, const char* str)
+{
+    if (node == NULL || str == NULL)
+        return false;
+
+    dtb_prop* compat_prop = dtb_find_prop(node, "compatible");
+    if (compat_prop == NULL)
+        return false;
+
+    const size_t str_len = string_len(str);
+    for (size_t i = 0; ; i++)
+    {
+        const char* check_str = dtb_read_prop_string(compat_prop, i);
+        if (check_str == NULL)
+            return false;
+        if (strings_eq(check_str, str, str_len + 1)) /* +1 so we don't match prefixes */
+            return true;
+    }
+}
+
+bool dtb_stat_node(dtb_node* node, dtb_node_stat* stat)
+{
+    if (node == NULL || stat == NULL)
+        return false;
+
+    stat->name = node->name;
+    if (node == read_state()->root)
+        stat->name = ROOT_NODE_STR;
+
+    stat->prop_count = 0;
+    dtb_prop* prop = node->props;
+    while (prop != NULL)
+    {
+        prop = prop->next;
+        stat->prop_count++;
+    }
+
+    stat->child_count = 0;
+    dtb_node* child = node->child;
+    while (child != NULL)
+    {
         child = child->sibling;
         stat->child_count++;
     }
 
-    stat->sibling_count = 0;
-    if (node->parent)
+    stat->sibling_count = 0;
+    if (node->parent)
+    {
+        dtb_node* prime = node->parent->child;
+        while (prime != NULL)
+        {
+            prime = prime->sibling;
+            stat->sibling_count++;
+        }
+    }
+
+    return true;
+}
+
+bool dtb_stat_prop(dtb_prop* prop, dtb_prop_stat* stat)
+{
+    if (prop == NULL || stat == NULL)
+        return false;
+
+    stat->name = prop->name;
+    stat->data = prop->data;
+    stat->data_len = prop->length;
+    return true;
+}
+
+const char* dtb_read_prop_string(dtb_prop* prop, size_t index)
+{
+    if (prop == NULL)
+        return NULL;
+    
+    const uint8_t* name = (const uint8_t*)prop->data;
+    size_t curr_index = 0;
+    for (size_t scan = 0; scan < prop->length; scan++)
+    {
+        if (name[scan] == 0)
+        {
+            curr_index++;
+            continue;
+        }
+        if (curr_index == index)
+            return (const char*)&name[scan];
+    }
+
+    return NULL;
+}
+
+size_t dtb_read_prop_1(dtb_prop* prop, size_t cell_count, uintmax_t* vals)
+{
+    if (prop == NULL || cell_count == 0)
+        return 0;
+    
+    const uint32_t* prop_cells = prop->data;
+    const size_t count = prop->length / (cell_count * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t* base = prop_cells + i * cell_count;
+        vals[i] = extract_cells(base, cell_count);
+    }
+
+    return count;
+}
+
+size_t dtb_read_prop_2(dtb_prop* prop, dtb_pair layout, dtb_pair* vals)
+{
+    if (prop == NULL || layout.a == 0 || layout.b == 0)
+        return 0;
+    
+    const uint32_t* prop_cells = prop->data;
+    const size_t count = prop->length / ((layout.a + layout.b) * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t* base = prop_cells + i * (layout.a + layout.b);
+        vals[i].a = extract_cells(base, layout.a);
+        vals[i].b = extract_cells(base + layout.a, layout.b);
+    }
+    return count;
+}
+
+size_t dtb_read_prop_3(dtb_prop* prop, dtb_triplet layout, dtb_triplet* vals)
+{
+    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0)
+        return 0;
+
+    const uint32_t* prop_cells = prop->data;
+    const size_t stride = layout.a + layout.b + layout.c;
+    const size_t count = prop->length / (stride * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t* base = prop_cells + i * stride;
+        vals[i].a = extract_cells(base, layout.a);
+        vals[i].b = extract_cells(base + layout.a, layout.b);
+        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
+    }
+    return count;
+}
+
+size_t dtb_read_prop_4(dtb_prop* prop, dtb_quad layout, dtb_quad* vals)
+{
+    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0 || layout.d == 0)
+        return 0;
+
+    const uint32_t* prop_cells = prop->data;
+    const size_t stride = layout.a + layout.b + layout.c + layout.d;
+    const size_t count = prop->length / (stride * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t* base = prop_cells + i * stride;
+        vals[i].a = extract_cells(base, layout.a); 
+        vals[i].b = extract_cells(base + layout.a, layout.b);
+        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
+        vals[i].d = extract_cells(base + layout.a + layout.b + layout.c, layout.d);
+    }
+    return count;
+}
+
+/* Builds a description for list properties not in phandle_ref_props, like "foos" whose
+ * provider has a "#foo-cells" property. The first cell must reference such a provider.
+ */
+static const struct phandle_ref_desc* guess_phandle_ref_desc(dtb_prop* prop, struct phandle_ref_desc* desc,
+    char* cells_buf, size_t buf_size)
+{
+    const size_t name_len = string_len(prop->name);
+    if (name_len < 2 || name_len + sizeof("#-cells") > buf_size || prop->name[name_len - 1] != 's'
+        || prop->length < FDT_CELL_SIZE || prop->data == NULL)
+        return NULL;
+
+    dtb_node* provider = dtb_find_phandle(be32(*(const uint32_t*)prop->data));
+    if (provider == NULL)
+        return NULL;
+
+    cells_buf[0] = '#';
+    memcpy(cells_buf + 1, prop->name, name_len - 1);
+    memcpy(cells_buf + name_len, "-cells", sizeof("-cells"));
+    if (dtb_find_prop(provider, cells_buf) == NULL)
+        return NULL;
+
+    desc->prop_name = prop->name;
+    desc->cells_name = cells_buf;
+    desc->default_cells = NO_DEFAULT_CELLS;
+    return desc;
+}
+
+static bool is_interrupts_prop(dtb_prop* prop)
+{
+    return strings_eq(prop->name, "interrupts", sizeof("interrupts"));
+}
+
+struct check_data
+{
+    bool (*report)(const dtb_check_issue* issue, void* opaque);
+    void* opaque;
+    size_t issue_count;
+    bool aborted;
+};
+
+static bool check_report(struct check_data* data, size_t kind, dtb_node* node, dtb_prop* prop, uint32_t handle,
+    dtb_node* provider)
+{
+    data->issue_count++;
+    if (data->report == NULL)
+        return true;
+
+    dtb_check_issue issue;
+    issue.kind = kind;
+    issue.node = node;
+    issue.prop = prop;
+    issue.handle = handle;
+    issue.provider = provider;
+    data->aborted = !data->report(&issue, data->opaque);
+    return !data->aborted;
+}
+
+static bool check_phandle_ref(const struct phandle_ref* ref, void* opaque)
+{
+    struct check_data* data = opaque;
+    if (ref->provider == NULL)
+        return check_report(data, SMOLDTB_CHECK_MISSING_PROVIDER, ref->prop->node, ref->prop, ref->handle, NULL);
+    if (ref->arg_cells == -1ul)
+        return check_report(data, SMOLDTB_CHECK_MISSING_CELLS, ref->prop->node, ref->prop, ref->handle, ref->provider);
+    if (ref->truncated)
+        return check_report(data, SMOLDTB_CHECK_BAD_ARG_COUNT, ref->prop->node, ref->prop, ref->handle, ref->provider);
+    return true;
+}
+
+static bool check_node_phandles(struct check_data* data, dtb_node* node)
+{
+    bool has_interrupts = false;
+    bool has_extended = false;
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+    {
+        if (is_phandle_name(prop->name))
+        {
+            /* the index only holds one node per phandle, any other node using it is a duplicate */
+            const uint32_t handle = read_phandle_value(prop);
+            if (handle == 0 || handle == 0xFFFFFFFF)
+            {
+                if (!check_report(data, SMOLDTB_CHECK_BAD_PHANDLE, node, prop, handle, NULL))
+                    return false;
+            }
+            else if (dtb_find_phandle(handle) != node)
+            {
+                if (!check_report(data, SMOLDTB_CHECK_DUPLICATE_PHANDLE, node, prop, handle, dtb_find_phandle(handle)))
+                    return false;
+            }
+            continue;
+        }
+
+        has_interrupts |= is_interrupts_prop(prop);
+        has_extended |= strings_eq(prop->name, "interrupts-extended", sizeof("interrupts-extended"));
+
+        struct phandle_ref_desc guessed;
+        char cells_buf[64];
+        const struct phandle_ref_desc* desc = find_phandle_ref_desc(prop->name);
+        if (desc == NULL && !is_interrupts_prop(prop))
+            desc = guess_phandle_ref_desc(prop, &guessed, cells_buf, sizeof(cells_buf));
+        if (desc == NULL)
+            continue;
+
+        if (prop->length % FDT_CELL_SIZE != 0)
+        {
+            if (!check_report(data, SMOLDTB_CHECK_BAD_ARG_COUNT, node, prop, 0, NULL))
+                return false;
+            continue;
+        }
+        if (!foreach_phandle_ref(prop, desc, check_phandle_ref, data))
+            return false;
+    }
+
+    /* plain 'interrupts' are decoded with the cell count of the (possibly inherited) interrupt parent */
+    if (!has_interrupts || has_extended)
+        return true;
+
+    dtb_node* parent = find_interrupt_parent(node);
+    if (parent == NULL)
+        return true;
+
+    dtb_prop* interrupts = dtb_find_prop(node, "interrupts");
+    const size_t cells = get_cells_helper(parent, "#interrupt-cells", NO_DEFAULT_CELLS);
+    if (cells == NO_DEFAULT_CELLS)
+        return check_report(data, SMOLDTB_CHECK_MISSING_CELLS, node, interrupts, 0, parent);
+    if (cells == 0 || interrupts->length % (cells * FDT_CELL_SIZE) != 0)
+        return check_report(data, SMOLDTB_CHECK_BAD_ARG_COUNT, node, interrupts, 0, parent);
+    return true;
+}
+
+size_t dtb_check_phandles(bool (*report)(const dtb_check_issue* issue, void* opaque), void* opaque)
+{
+    struct check_data data;
+    data.report = report;
+    data.opaque = opaque;
+    data.issue_count = 0;
+    data.aborted = false;
+
+    for (dtb_node* scan = read_state()->root; scan != NULL; scan = next_node_preorder(scan))
+    {
+        if (!check_node_phandles(&data, scan))
+            break;
+    }
+
+    return data.issue_count;
+}
+
+#ifdef SMOLDTB_ENABLE_WRITE_API
+/* ---- Section: Writable-Mode Private Functions ---- */
+
+struct finalise_data
+{
+    uint32_t* struct_buf;
+    char* string_buf;
+    size_t struct_ptr;
+    size_t string_ptr;
+    size_t struct_buf_size;
+    size_t string_buf_size;
+    size_t struct_offset;
+    dtb_template_slot* slots;
+    size_t slot_count;
+    dtb_node** selection;
+    size_t selection_count;
+    dtb_node* anonymous_root;
+    bool print_success;
+};
+
+struct name_collision_check
+{
+    const char* name;
+    size_t name_len;
+    bool collision;
+};
+
+static int destroy_props(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)opaque;
+
+    if (is_phandle_name(prop->name))
+        remove_phandle(read_phandle_value(prop), node);
+
+    if (prop->dataFromMalloc)
+        try_free(prop->data, prop->length);
+    if (prop->fromMalloc)
+    {
+        try_free((void*)prop->name, string_len(prop->name) + 1);
+        try_free(prop, sizeof(dtb_prop));
+    }
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static void destroy_dead_node(dtb_node* node)
+{
+    if (node == NULL || node->parent != NULL)
+        return;
+
+    while (node->child != NULL)
+    {
+        dtb_node* deletee = node->child;
+        node->child = node->child->sibling;
+
+        deletee->parent = NULL;
+        destroy_dead_node(deletee);
+    }
+
+    do_foreach_prop(node, destroy_props, NULL);
+    if (node->fromMalloc)
+    {
+        if (node->name != NULL)
+            try_free((void*)node->name, string_len(node->name) + 1);
+        try_free(node, sizeof(dtb_node));
+    }
+}
+
+/* While a snapshot is open every change to the tree is recorded in the undo log, and
+ * anything that would be freed is kept alive by the log instead. Rolling back replays the
+ * log in reverse, releasing the last snapshot frees whatever the log was keeping alive.
+ * Each snapshot also has an entry in the log, so rolling back knows which snapshots were
+ * taken after the one it's rolling back to (and closes them too).
+ */
+#define UNDO_NODE_CREATED 0
+#define UNDO_NODE_DESTROYED 1
+#define UNDO_PROP_CREATED 2
+#define UNDO_PROP_DESTROYED 3
+#define UNDO_DATA_CHANGED 4
+#define UNDO_SNAPSHOT 5
+#define UNDO_SNAPSHOT_RELEASED 6
+
+struct dtb_undo_entry
+{
+    size_t kind;
+    dtb_node* node;
+    dtb_prop* prop;
+    dtb_node* parent;
+    void* prev; /* previous sibling or property, for relinking */
+    void* data;
+    uint32_t length;
+    bool dataFromMalloc;
+};
+
+static bool reserve_undo_entries(size_t count)
+{
+    if (state->snapshot_count == 0 || state->undo_count + count <= state->undo_capacity)
+        return true;
+
+    size_t new_capacity = state->undo_capacity == 0 ? 32 : state->undo_capacity * 2;
+    while (new_capacity < state->undo_count + count)
+        new_capacity *= 2;
+
+    struct dtb_undo_entry* new_log = try_malloc(new_capacity * sizeof(struct dtb_undo_entry));
+    if (new_log == NULL)
+    {
+        LOG_ERROR("Failed to grow undo log.");
+        return false;
+    }
+
+    memcpy(new_log, state->undo_log, state->undo_count * sizeof(struct dtb_undo_entry));
+    if (state->undo_log != NULL)
+        try_free(state->undo_log, state->undo_capacity * sizeof(struct dtb_undo_entry));
+    state->undo_log = new_log;
+    state->undo_capacity = new_capacity;
+    return true;
+}
+
+/* Records a change that is about to happen, returns false if the change must not go ahead. */
+static bool log_undo(size_t kind, dtb_node* node, dtb_prop* prop)
+{
+    if (state->snapshot_count == 0)
+        return true;
+
+    LOCK(&state->lock);
+    if (!reserve_undo_entries(1))
+    {
+        UNLOCK(&state->lock);
+        return false;
+    }
+
+    struct dtb_undo_entry* entry = &state->undo_log[state->undo_count++];
+    entry->kind = kind;
+    entry->node = node;
+    entry->prop = prop;
+    entry->parent = node == NULL ? NULL : node->parent;
+    entry->prev = NULL;
+    entry->data = NULL;
+    entry->length = 0;
+    entry->dataFromMalloc = false;
+
+    if (kind == UNDO_NODE_DESTROYED)
+        entry->prev = node->prev;
+    else if (kind == UNDO_PROP_DESTROYED)
+        entry->prev = prop->prev;
+    else if (kind == UNDO_DATA_CHANGED)
+    {
+        entry->data = prop->data;
+        entry->length = prop->length;
+        entry->dataFromMalloc = prop->dataFromMalloc;
+    }
+    UNLOCK(&state->lock);
+    return true;
+}
+
+static bool is_logging_undo()
+{
+    return state->snapshot_count != 0;
+}
+
+/* Nodes destroyed while a snapshot is open are kept intact, but their phandles need
+ * to disappear from (and possibly reappear in) the lookup table.
+ */
+static void update_subtree_phandles(dtb_node* node, bool add)
+{
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+    {
+        if (!is_phandle_name(prop->name))
+            continue;
+        if (add)
+            insert_phandle(read_phandle_value(prop), node);
+        else
+            remove_phandle(read_phandle_value(prop), node);
+    }
+
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+        update_subtree_phandles(child, add);
+}
+
+static void undo_entry(struct dtb_undo_entry* entry)
+{
+    switch (entry->kind)
+    {
+    case UNDO_NODE_CREATED:
+        invalidate_refs(entry->node, NULL);
+        unlink_node(entry->node);
+        entry->node->parent = NULL;
+        destroy_dead_node(entry->node);
+        break;
+    case UNDO_NODE_DESTROYED:
+        link_node(entry->parent, entry->prev, entry->node);
+        update_subtree_phandles(entry->node, true);
+        break;
+    case UNDO_PROP_CREATED:
+        invalidate_refs(entry->node, entry->prop);
+        unlink_prop(entry->prop);
+        destroy_props(entry->node, entry->prop, NULL);
+        break;
+    case UNDO_PROP_DESTROYED:
+        link_prop(entry->node, entry->prev, entry->prop);
+        check_for_special_prop(entry->node, entry->prop);
+        break;
+    case UNDO_DATA_CHANGED:
+    {
+        dtb_prop* prop = entry->prop;
+        if (is_phandle_name(prop->name))
+            remove_phandle(read_phandle_value(prop), prop->node);
+        if (strings_eq(prop->name, "compatible", sizeof("compatible")))
+            index_compat_changed(prop->node, false);
+        if (prop->dataFromMalloc)
+            try_free(prop->data, prop->length);
+
+        prop->data = entry->data;
+        prop->length = entry->length;
+        prop->dataFromMalloc = entry->dataFromMalloc;
+        check_for_special_prop(prop->node, prop);
+        break;
+    }
+    }
+}
+
+/* Called once the changes in the log are permanent, frees anything it kept alive. */
+static void commit_undo_entry(struct dtb_undo_entry* entry)
+{
+    switch (entry->kind)
+    {
+    case UNDO_NODE_DESTROYED:
+        destroy_dead_node(entry->node);
+        break;
+    case UNDO_PROP_DESTROYED:
+        destroy_props(entry->node, entry->prop, NULL);
+        break;
+    case UNDO_DATA_CHANGED:
+        if (entry->dataFromMalloc)
+            try_free(entry->data, entry->length);
+        break;
+    }
+}
+
+static void discard_undo_log()
+{
+    for (size_t i = 0; i < state->undo_count; i++)
+        commit_undo_entry(&state->undo_log[i]);
+
+    if (state->undo_log != NULL)
+        try_free(state->undo_log, state->undo_capacity * sizeof(struct dtb_undo_entry));
+    state->undo_log = NULL;
+    state->undo_count = 0;
+    state->undo_capacity = 0;
+    state->snapshot_count = 0;
+}
+
+static dtb_template_slot* find_template_slot(struct finalise_data* data, dtb_prop* prop)
+{
+    for (size_t i = 0; i < data->slot_count; i++)
+    {
+        if (data->slots[i].prop == prop)
+            return &data->slots[i];
+    }
+
+    return NULL;
+}
+
+/* Returns the number of cells reserved for a property's data. Template slots may reserve
+ * more space than the current value needs, the excess is filled with FDT_NOP tokens.
+ */
+static size_t prop_reserved_cells(struct finalise_data* data, dtb_prop* prop)
+{
+    size_t length = prop->length;
+    dtb_template_slot* slot = find_template_slot(data, prop);
+    if (slot != NULL)
+        length = slot->capacity;
+
+    return dtb_align_up(length, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+}
+
+static int init_finalise_data_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)node;
+    if (node == NULL || prop == NULL)
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    struct finalise_data* data = opaque;
+    data->struct_buf_size += 3; /* +1 for FDT_PROP token, +2 for prop description struct */
+    data->struct_buf_size += prop_reserved_cells(data, prop);
+    data->string_buf_size += string_len(prop->name) + 1; /* +1 for null terminator */
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+/* The node being finalised as the root of a subtree is given an empty name */
+static const char* finalise_name_of(struct finalise_data* data, dtb_node* node)
+{
+    return node == data->anonymous_root ? NULL : node->name;
+}
+
+static int init_finalise_data(dtb_node* node, void* opaque)
+{
+    if (node == NULL)
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    struct finalise_data* data = opaque;
+    data->struct_buf_size += 2; /* +1 for BEGIN_NODE token, +1 for END_NODE token */
+    data->struct_buf_size += dtb_align_up(string_len(finalise_name_of(data, node)) + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE; /* +1 for null terminator */
+
+    do_foreach_prop(node, init_finalise_data_prop, opaque);
+    do_foreach_sibling(node->child, init_finalise_data, opaque);
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static int print_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)node;
+    struct finalise_data* data = opaque;
+
+    const uint32_t name_offset = data->string_ptr;
+    const size_t name_len = string_len(prop->name);
+    if (data->string_ptr + name_len + 1 > data->string_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return SMOLDTB_FOREACH_ABORT;
+    }
+
+    memcpy(data->string_buf + data->string_ptr, prop->name, name_len);
+    data->string_buf[data->string_ptr + name_len] = 0;
+    data->string_ptr += name_len + 1; /* +1 for null terminator */
+
+    const size_t data_cells = dtb_align_up(prop->length, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+    const size_t reserved_cells = prop_reserved_cells(data, prop);
+    if (data->struct_ptr + 3 + reserved_cells > data->struct_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return SMOLDTB_FOREACH_ABORT;
+    }
+
+    dtb_template_slot* slot = find_template_slot(data, prop);
+    if (slot != NULL)
+        slot->offset = data->struct_offset + (data->struct_ptr + 1) * FDT_CELL_SIZE;
+
+    data->struct_buf[data->struct_ptr++] = be32(FDT_PROP);
+    data->struct_buf[data->struct_ptr++] = be32((uint32_t)prop->length);
+    data->struct_buf[data->struct_ptr++] = be32(name_offset);
+
+    /* copy whole cells, then the trailing bytes (if any) with zero padding */
+    const uint32_t* prop_cells = prop->data;
+    const size_t whole_cells = prop->length / FDT_CELL_SIZE;
+    for (size_t i = 0; i < whole_cells; i++)
+        data->struct_buf[data->struct_ptr++] = prop_cells[i];
+
+    if (whole_cells != data_cells)
+    {
+        uint8_t* tail = (uint8_t*)(data->struct_buf + data->struct_ptr);
+        const uint8_t* src_tail = (const uint8_t*)(prop_cells + whole_cells);
+        for (size_t i = 0; i < FDT_CELL_SIZE; i++)
+            tail[i] = (whole_cells * FDT_CELL_SIZE + i < prop->length) ? src_tail[i] : 0;
+        data->struct_ptr++;
+    }
+
+    for (size_t i = data_cells; i < reserved_cells; i++)
+        data->struct_buf[data->struct_ptr++] = be32(FDT_NOP);
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static bool print_node_begin(struct finalise_data* data, dtb_node* node)
+{
+    const char* name = finalise_name_of(data, node);
+    const size_t name_len = string_len(name);
+    const size_t name_cells = dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+
+    if (data->struct_ptr + 1 + name_cells > data->struct_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return false;
+    }
+
+    data->struct_buf[data->struct_ptr++] = be32(FDT_BEGIN_NODE);
+
+    data->struct_buf[data->struct_ptr + name_cells - 1] = 0; /* zero any padding after the name */
+    uint8_t* name_buf = (uint8_t*)(data->struct_buf + data->struct_ptr);
+    memcpy(name_buf, name, name_len);
+    name_buf[name_len] = 0;
+    data->struct_ptr += name_cells;
+
+    return true;
+}
+
+static bool print_node_end(struct finalise_data* data)
+{
+    if (data->struct_ptr + 1 > data->struct_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return false;
+    }
+    data->struct_buf[data->struct_ptr++] = be32(FDT_END_NODE);
+
+    return true;
+}
+
+static int print_node(dtb_node* node, void* opaque)
+{
+    struct finalise_data* data = opaque;
+    if (!print_node_begin(data, node))
+        return SMOLDTB_FOREACH_ABORT;
+
+    do_foreach_prop(node, print_prop, opaque);
+    if (!data->print_success)
+        return SMOLDTB_FOREACH_ABORT;
+    do_foreach_sibling(node->child, print_node, opaque);
+    if (!data->print_success)
+        return SMOLDTB_FOREACH_ABORT;
+
+    if (!print_node_end(data))
+        return SMOLDTB_FOREACH_ABORT;
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+/* When finalising a selection of subtrees, the selected nodes are emitted in full. Their
+ * ancestors are emitted as a 'skeleton' that only contains the properties needed to
+ * interpret addresses below them, and any interrupt-parent the selected nodes inherit.
+ */
+static bool selection_covers(struct finalise_data* data, dtb_node* node)
+{
+    for (dtb_node* scan = node; scan != NULL; scan = scan->parent)
+    {
+        for (size_t i = 0; i < data->selection_count; i++)
+        {
+            if (data->selection[i] == scan)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+static bool selection_below(struct finalise_data* data, dtb_node* node)
+{
+    for (size_t i = 0; i < data->selection_count; i++)
+    {
+        for (dtb_node* scan = data->selection[i]->parent; scan != NULL; scan = scan->parent)
+        {
+            if (scan == node)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+static bool is_skeleton_prop(dtb_prop* prop)
+{
+    const char* names[] = { "#address-cells", "#size-cells", "ranges", "interrupt-parent" };
+    const size_t name_len = string_len(prop->name);
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (name_len == string_len(names[i]) && strings_eq(prop->name, names[i], name_len))
+            return true;
+    }
+
+    return false;
+}
+
+static int init_finalise_skeleton_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    if (!is_skeleton_prop(prop))
+        return SMOLDTB_FOREACH_CONTINUE;
+    return init_finalise_data_prop(node, prop, opaque);
+}
+
+static int print_skeleton_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    if (!is_skeleton_prop(prop))
+        return SMOLDTB_FOREACH_CONTINUE;
+    return print_prop(node, prop, opaque);
+}
+
+static int init_finalise_skeleton(dtb_node* node, void* opaque)
+{
+    struct finalise_data* data = opaque;
+    if (selection_covers(data, node))
+        return init_finalise_data(node, opaque);
+    if (!selection_below(data, node))
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    data->struct_buf_size += 2; /* +1 for BEGIN_NODE token, +1 for END_NODE token */
+    data->struct_buf_size += dtb_align_up(string_len(node->name) + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+
+    do_foreach_prop(node, init_finalise_skeleton_prop, opaque);
+    do_foreach_sibling(node->child, init_finalise_skeleton, opaque);
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static int print_skeleton(dtb_node* node, void* opaque)
+{
+    struct finalise_data* data = opaque;
+    if (selection_covers(data, node))
+        return print_node(node, opaque);
+    if (!selection_below(data, node))
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    if (!print_node_begin(data, node))
+        return SMOLDTB_FOREACH_ABORT;
+
+    do_foreach_prop(node, print_skeleton_prop, opaque);
+    if (!data->print_success)
+        return SMOLDTB_FOREACH_ABORT;
+    do_foreach_sibling(node->child, print_skeleton, opaque);
+    if (!data->print_success)
+        return SMOLDTB_FOREACH_ABORT;
+
+    if (!print_node_end(data))
+        return SMOLDTB_FOREACH_ABORT;
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static int check_sibling_name_collisions(dtb_node* node, void* opaque)
+{
+    struct name_collision_check* check = opaque;
+
+    if (!strings_eq(node->name, check->name, check->name_len) || node->name[check->name_len] != 0)
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    check->collision = true;
+    return SMOLDTB_FOREACH_ABORT;
+}
+
+static int check_prop_name_collisions(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)node;
+    struct name_collision_check* check = opaque;
+
+    if (!strings_eq(prop->name, check->name, check->name_len) || prop->name[check->name_len] != 0)
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    check->collision = true;
+    return SMOLDTB_FOREACH_ABORT;
+}
+
+/* ---- Section: Writable-Mode Public API ---- */
+
+static void init_finalise_options(struct finalise_data* data)
+{
+    data->slots = NULL;
+    data->slot_count = 0;
+    data->selection = NULL;
+    data->selection_count = 0;
+    data->anonymous_root = NULL;
+}
+
+/* Finalises either the whole tree, a single subtree (anonymous_root) or a selection of
+ * subtrees and their ancestors, depending on what options are set in `final_data`. */
+static size_t finalise_internal(void* buffer, size_t buffer_size, uint32_t boot_cpu_id, struct finalise_data* options)
+{
+    struct finalise_data final_data = *options;
+    final_data.struct_buf_size = 1; /* +1 for the FDT_END token */
+    final_data.string_buf_size = 1; /* we'll use 1 byte for the empty string */
+
+    if (final_data.selection_count != 0)
+        do_foreach_sibling(state->root, init_finalise_skeleton, &final_data);
+    else if (final_data.anonymous_root != NULL)
+        init_finalise_data(final_data.anonymous_root, &final_data);
+    else
+        do_foreach_sibling(state->root, init_finalise_data, &final_data);
+    const size_t reserved_block_size = 2 * sizeof(uint64_t);
+    const size_t struct_buf_bytes = final_data.struct_buf_size * FDT_CELL_SIZE;
+    const size_t total_bytes = final_data.string_buf_size + struct_buf_bytes + 
+        sizeof(struct fdt_header) + reserved_block_size;
+
+    if (buffer == NULL || buffer_size < total_bytes)
+        return total_bytes;
+    if ((uintptr_t)buffer & 0b11)
+        return SMOLDTB_FINALISE_FAILURE; /* check buffer is aligned to a 32-bit boundary */
+
+    struct fdt_header* header = (struct fdt_header*)buffer;
+    header->magic = be32(FDT_MAGIC);
+    header->total_size = be32(total_bytes);
+    header->offset_structs = be32(sizeof(struct fdt_header) + 16); /* size of reserved block */
+    header->offset_strings = be32(be32(header->offset_structs) + struct_buf_bytes);
+    header->offset_memmap_rsvd = be32(sizeof(struct fdt_header));
+    header->version = be32(FDT_VERSION);
+    header->last_comp_version = be32(16); /* as per spec, this field must be 16. */
+    header->boot_cpu_id = be32(boot_cpu_id);
+    header->size_strings = be32(final_data.string_buf_size);
+    header->size_structs = be32(struct_buf_bytes);
+
+    /* Apparently the great minds behind the device tree spec were able to think far enough
+     * ahead to include size fields for the string and structure blocks, but not
+     * the reserved memory block. The end of this block is indicated by an entry filled
+     * with zeroes, because a size field would be too easy.
+     * So even though we dont use this block, we must include a single entry for it. */
+    uint64_t* reserved_block = (uint64_t*)(header + 1);
+    reserved_block[0] = 0;
+    reserved_block[1] = 0;
+
+    final_data.struct_buf = (uint32_t*)((uintptr_t)buffer + be32(header->offset_structs));
+    final_data.string_buf = (char*)((uintptr_t)buffer + be32(header->offset_strings));
+    final_data.struct_ptr = 0;
+    final_data.string_ptr = 1;
+    final_data.string_buf[0] = 0;
+
+    final_data.struct_offset = be32(header->offset_structs);
+    for (size_t i = 0; i < final_data.slot_count; i++)
+        final_data.slots[i].offset = 0;
+
+    final_data.print_success = true;
+    if (final_data.selection_count != 0)
+        do_foreach_sibling(state->root, print_skeleton, &final_data);
+    else if (final_data.anonymous_root != NULL)
+        print_node(final_data.anonymous_root, &final_data);
+    else
+        do_foreach_sibling(state->root, print_node, &final_data);
+    if (!final_data.print_success || final_data.struct_ptr + 1 > final_data.struct_buf_size)
+        return SMOLDTB_FINALISE_FAILURE;
+
+    final_data.struct_buf[final_data.struct_ptr++] = be32(FDT_END);
+    return total_bytes;
+}
+
+size_t dtb_finalise_to_buffer(void* buffer, size_t buffer_size, uint32_t boot_cpu_id)
+{
+    struct finalise_data options;
+    init_finalise_options(&options);
+    return finalise_internal(buffer, buffer_size, boot_cpu_id, &options);
+}
+
+size_t dtb_finalise_template(void* buffer, size_t buffer_size, uint32_t boot_cpu_id, dtb_template_slot* slots, size_t slot_count)
+{
+    if (slots == NULL && slot_count != 0)
+        return SMOLDTB_FINALISE_FAILURE;
+
+    /* the reserved space always fits the current value, record that so the slots can
+     * be used to patch blobs after the tree itself is gone. */
+    for (size_t i = 0; i < slot_count; i++)
+    {
+        if (slots[i].prop != NULL && slots[i].prop->length > slots[i].capacity)
+            slots[i].capacity = slots[i].prop->length;
+    }
+
+    struct finalise_data options;
+    init_finalise_options(&options);
+    options.slots = slots;
+    options.slot_count = slot_count;
+    return finalise_internal(buffer, buffer_size, boot_cpu_id, &options);
+}
+
+struct provider_list
+{
+    dtb_node** nodes;
+    size_t count;
+    size_t capacity;
+    bool failed;
+};
+
+static bool add_to_provider_list(struct provider_list* list, dtb_node* node)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (list->nodes[i] == node)
+            return true;
+    }
+
+    if (list->count == list->capacity)
+    {
+        const size_t new_capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+        dtb_node** new_nodes = try_malloc(new_capacity * sizeof(dtb_node*));
+        if (new_nodes == NULL)
+        {
+            list->failed = true;
+            return false;
+        }
+
+        for (size_t i = 0; i < list->count; i++)
+            new_nodes[i] = list->nodes[i];
+        if (list->nodes != NULL)
+            try_free(list->nodes, list->capacity * sizeof(dtb_node*));
+        list->nodes = new_nodes;
+        list->capacity = new_capacity;
+    }
+
+    list->nodes[list->count++] = node;
+    return true;
+}
+
+static bool collect_provider(const struct phandle_ref* ref, void* opaque)
+{
+    if (ref->provider == NULL)
+        return true;
+    return add_to_provider_list(opaque, ref->provider);
+}
+
+/* Adds every node referenced by phandle from within the listed subtrees, or by the
+ * interrupt-parent of one of their ancestors (since the skeleton keeps those). Providers are
+ * appended to the same list, so their own references are picked up too.
+ */
+static void collect_providers(struct provider_list* list)
+{
+    for (size_t i = 0; i < list->count && !list->failed; i++)
+    {
+        dtb_node* top = list->nodes[i];
+        for (dtb_node* scan = top->parent; scan != NULL && !list->failed; scan = scan->parent)
+        {
+            dtb_prop* prop = dtb_find_prop(scan, "interrupt-parent");
+            dtb_node* parent = (prop == NULL) ? NULL : dtb_find_phandle(read_phandle_value(prop));
+            if (parent != NULL)
+                add_to_provider_list(list, parent);
+        }
+
+        for (dtb_node* scan = top; scan != NULL && !list->failed; )
+        {
+            for (dtb_prop* prop = scan->props; prop != NULL; prop = prop->next)
+            {
+                const struct phandle_ref_desc* desc = find_phandle_ref_desc(prop->name);
+                if (desc != NULL)
+                    foreach_phandle_ref(prop, desc, collect_provider, list);
+            }
+
+            if (dtb_find_prop(scan, "interrupts") != NULL)
+            {
+                dtb_node* parent = find_interrupt_parent(scan);
+                if (parent != NULL)
+                    add_to_provider_list(list, parent);
+            }
+
+            /* depth-first walk, limited to the subtree under 'top' */
+            if (scan->child != NULL)
+                scan = scan->child;
+            else
+            {
+                while (scan != top && scan->sibling == NULL)
+                    scan = scan->parent;
+                scan = (scan == top) ? NULL : scan->sibling;
+            }
+        }
+    }
+}
+
+size_t dtb_finalise_subtree(dtb_node* node, void* buffer, size_t buffer_size, size_t flags)
+{
+    if (node == NULL)
+        return SMOLDTB_FINALISE_FAILURE;
+
+    struct finalise_data options;
+    init_finalise_options(&options);
+
+    if ((flags & (SMOLDTB_SUBTREE_SYNTH_ROOT | SMOLDTB_SUBTREE_WITH_PROVIDERS)) == 0)
+    {
+        options.anonymous_root = node;
+        return finalise_internal(buffer, buffer_size, 0, &options);
+    }
+
+    struct provider_list list;
+    list.nodes = NULL;
+    list.count = list.capacity = 0;
+    list.failed = false;
+    add_to_provider_list(&list, node);
+    if (flags & SMOLDTB_SUBTREE_WITH_PROVIDERS)
+        collect_providers(&list);
+
+    size_t result = SMOLDTB_FINALISE_FAILURE;
+    if (!list.failed)
+    {
+        options.selection = list.nodes;
+        options.selection_count = list.count;
+        result = finalise_internal(buffer, buffer_size, 0, &options);
+    }
+
+    if (list.nodes != NULL)
+        try_free(list.nodes, list.capacity * sizeof(dtb_node*));
+    return result;
+}
+
+bool dtb_template_patch(void* blob, const dtb_template_slot* slot, const void* data, size_t length)
+{
+    if (blob == NULL || slot == NULL || slot->offset == 0)
+        return false;
+    if (data == NULL && length != 0)
+        return false;
+
+    const size_t capacity = slot->capacity;
+    if (length > capacity)
+        return false;
+
+    /* slot->offset points to the length field, followed by the name offset and then the data */
+    uint32_t* cells = (uint32_t*)((uintptr_t)blob + slot->offset);
+    cells[0] = be32((uint32_t)length);
+
+    uint8_t* dest = (uint8_t*)(cells + 2);
+    memcpy(dest, data, length);
+    const size_t data_cells = dtb_align_up(length, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+    for (size_t i = length; i < data_cells * FDT_CELL_SIZE; i++)
+        dest[i] = 0;
+
+    const size_t reserved_cells = dtb_align_up(capacity, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+    for (size_t i = data_cells; i < reserved_cells; i++)
+        cells[2 + i] = be32(FDT_NOP);
+
+    return true;
+}
+
+static dtb_node* create_node_internal(dtb_node* parent, dtb_node* prev, const char* name);
+static dtb_prop* create_prop_internal(dtb_node* node, const char* name);
+
+dtb_node* dtb_find_or_create_node(const char* path)
+{
+    if (path == NULL)
+        return NULL;
+
+    LOCK(&state->root_lock);
+    if (state->root == NULL)
+    {
+        /* empty trees have no root yet, so create one for the path to start from */
+        state->root = try_malloc(sizeof(dtb_node));
+        if (state->root == NULL)
+        {
+            UNLOCK(&state->root_lock);
+            LOG_ERROR("Failed to allocate root node.");
+            return NULL;
+        }
+
+        state->root->parent = NULL;
+        state->root->sibling = NULL;
+        state->root->prev = NULL;
+        state->root->child = NULL;
+        state->root->props = NULL;
+        state->root->name = NULL;
+        state->root->ref_slot = 0;
+        state->root->fromMalloc = true;
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+        state->root->lock = 0;
+#endif
+        if (!log_undo(UNDO_NODE_CREATED, state->root, NULL))
+        {
+            try_free(state->root, sizeof(dtb_node));
+            state->root = NULL;
+            UNLOCK(&state->root_lock);
+            return NULL;
+        }
+    }
+    dtb_node* scan = state->root;
+    UNLOCK(&state->root_lock);
+
+    size_t seg_len;
+    while (scan != NULL)
+    {
+        while (path[0] == '/')
+            path++;
+
+        seg_len = string_find_char(path, '/');
+        if (seg_len == -1ul)
+            seg_len = string_len(path);
+        if (seg_len == 0)
+            return scan;
+
+        /* lookup and creation happen under one lock, so concurrent callers agree on the node */
+        LOCK(&scan->lock);
+        dtb_node* next = find_child_internal(scan, path, seg_len);
+        if (next == NULL)
+            next = create_node_internal(scan, NULL, path);
+        UNLOCK(&scan->lock);
+        scan = next;
+        path += seg_len;
+    }
+
+    return NULL;
+}
+
+dtb_prop* dtb_find_or_create_prop(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL)
+        return NULL;
+
+    LOCK(&node->lock);
+    dtb_prop* prop = dtb_find_prop(node, name);
+    if (prop == NULL)
+        prop = create_prop_internal(node, name);
+    UNLOCK(&node->lock);
+    return prop;
+}
+
+/* The caller must hold the parent's lock. */
+static dtb_node* create_node_internal(dtb_node* parent, dtb_node* prev, const char* name)
+{
+    struct name_collision_check check_data;
+    check_data.collision = false;
+    check_data.name = name;
+    check_data.name_len = string_len(name);
+    if (string_find_char(name, '/') < check_data.name_len)
+        check_data.name_len = string_find_char(name, '/');
+
+    do_foreach_sibling(parent->child, check_sibling_name_collisions, &check_data);
+    if (check_data.collision)
+    {
+        LOG_ERROR("Failed to create node with duplicate name.");
+        return NULL;
+    }
+
+    const size_t name_len = check_data.name_len;
+    char* name_buf = try_malloc(name_len + 1);
+    if (name_buf == NULL)
+        return NULL;
+    memcpy(name_buf, name, name_len);
+    name_buf[name_len] = 0;
+
+    dtb_node* node = try_malloc(sizeof(dtb_node));
+    if (node == NULL)
+    {
+        try_free(name_buf, name_len + 1);
+        LOG_ERROR("Failed to allocate node.");
+        return NULL;
+    }
+
+    node->name = name_buf;
+    node->child = NULL;
+    node->props = NULL;
+    node->ref_slot = 0;
+    node->fromMalloc = true;
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+    node->lock = 0;
+#endif
+    link_node(parent, prev, node);
+    if (!log_undo(UNDO_NODE_CREATED, node, NULL))
+    {
+        unlink_node(node);
+        node->parent = NULL;
+        destroy_dead_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+dtb_node* dtb_create_sibling(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL || node->parent == NULL) /* creating siblings of root node is disallowed */
+        return NULL;
+
+    LOCK(&node->parent->lock);
+    dtb_node* sibling = create_node_internal(node->parent, node, name);
+    UNLOCK(&node->parent->lock);
+    return sibling;
+}
+
+dtb_node* dtb_create_sibling_before(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL || node->parent == NULL)
+        return NULL;
+
+    LOCK(&node->parent->lock);
+    dtb_node* sibling = create_node_internal(node->parent, node->prev, name);
+    UNLOCK(&node->parent->lock);
+    return sibling;
+}
+
+dtb_node* dtb_create_child(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL)
+        return NULL;
+
+    LOCK(&node->lock);
+    dtb_node* child = create_node_internal(node, NULL, name);
+    UNLOCK(&node->lock);
+    return child;
+}
+
+/* The caller must hold the node's lock. */
+static dtb_prop* create_prop_internal(dtb_node* node, const char* name)
+{
+    const size_t name_len = string_len(name);
+    struct name_collision_check check_data;
+    check_data.collision = false;
+    check_data.name = name;
+    check_data.name_len = name_len;
+
+    do_foreach_prop(node, check_prop_name_collisions, &check_data);
+    if (check_data.collision)
+    {
+        LOG_ERROR("Failed to create prop with duplicate name.");
+        return NULL;
+    }
+
+    char* name_buf = try_malloc(name_len + 1);
+    if (name_buf == NULL)
+        return NULL;
+    memcpy(name_buf, name, name_len);
+    name_buf[name_len] = 0;
+
+    dtb_prop* prop = try_malloc(sizeof(dtb_prop));
+    if (prop == NULL)
+    {
+        try_free(name_buf, name_len + 1);
+        LOG_ERROR("Failed to allocate property");
+        return NULL;
+    }
+
+    prop->length = 0;
+    prop->data = NULL;
+    prop->name = name_buf;
+    prop->ref_slot = 0;
+    prop->fromMalloc = true;
+    prop->dataFromMalloc = false;
+    link_prop(node, NULL, prop);
+    if (!log_undo(UNDO_PROP_CREATED, node, prop))
+    {
+        unlink_prop(prop);
+        destroy_props(node, prop, NULL);
+        return NULL;
+    }
+    return prop;
+}
+
+dtb_prop* dtb_create_prop(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL)
+        return NULL;
+
+    LOCK(&node->lock);
+    dtb_prop* prop = create_prop_internal(node, name);
+    UNLOCK(&node->lock);
+    return prop;
+}
+
+bool dtb_destroy_node(dtb_node* node)
+{
+    if (node == NULL)
+        return false;
+
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+    int* list_lock = node->parent == NULL ? &state->root_lock : &node->parent->lock;
+#endif
+    LOCK(list_lock);
+    if (!log_undo(UNDO_NODE_DESTROYED, node, NULL))
+    {
+        UNLOCK(list_lock);
+        return false;
+    }
+
+    unlink_node(node);
+    node->parent = NULL;
+    UNLOCK(list_lock);
+    invalidate_refs(node, NULL);
+
+    /* the node is no longer reachable, so the rest doesn't need any locks */
+    if (is_logging_undo())
+        update_subtree_phandles(node, false);
+    else
+        destroy_dead_node(node);
+    return true;
+}
+
+bool dtb_destroy_prop(dtb_prop* prop)
+{
+    if (prop == NULL)
+        return false;
+
+    dtb_node* node = prop->node;
+    LOCK(&node->lock);
+    if (!log_undo(UNDO_PROP_DESTROYED, node, prop))
+    {
+        UNLOCK(&node->lock);
+        return false;
+    }
+
+    unlink_prop(prop);
+    UNLOCK(&node->lock);
+    invalidate_refs(node, prop);
+    if (is_logging_undo())
+    {
+        if (is_phandle_name(prop->name))
+            remove_phandle(read_phandle_value(prop), prop->node);
+    }
+    else
+        destroy_props(prop->node, prop, NULL);
+    return true;
+}
+
+/* The caller must hold the lock of the node the property belongs to. */
+static bool ensure_prop_has_buffer_for(dtb_prop* prop, size_t buf_size)
+{
+    if (prop == NULL)
+        return false;
+
+    /* with a snapshot open the old buffer belongs to the undo log, so it can't be reused */
+    const bool logging = is_logging_undo();
+    if (!log_undo(UNDO_DATA_CHANGED, prop->node, prop))
+        return false;
+
+    /* The contents are about to be overwritten, so drop any lookup entries that depend
+     * on them. The caller re-registers them with check_for_special_prop() once the new
+     * data is in place. */
+    if (is_phandle_name(prop->name))
+        remove_phandle(read_phandle_value(prop), prop->node);
+    const bool is_compat = strings_eq(prop->name, "compatible", sizeof("compatible"));
+    if (is_compat)
+        index_compat_changed(prop->node, false);
+
+    if (!logging && prop->dataFromMalloc && buf_size == prop->length)
+        return true;
+
+    void* new_data = try_malloc(buf_size);
+    if (new_data == NULL)
+    {
+        if (is_compat)
+            index_compat_changed(prop->node, true); //the old contents are still there
+        return false;
+    }
+    if (prop->dataFromMalloc && !logging)
+        try_free(prop->data, prop->length);
+
+    prop->data = new_data;
+    prop->length = buf_size;
+    prop->dataFromMalloc = true;
+    return true;
+}
+
+unsigned dtb_alloc_phandle(dtb_node* node)
+{
+    if (node == NULL)
+        return 0;
+
+    /* either 'phandle' or the older 'linux,phandle' may already hold a handle */
+    LOCK(&node->lock);
+    dtb_prop* prop = NULL;
+    for (dtb_prop* scan = node->props; scan != NULL; scan = scan->next)
+    {
+        if (!is_phandle_name(scan->name))
+            continue;
+
+        const uint32_t existing = read_phandle_value(scan);
+        if (existing != 0)
+        {
+            UNLOCK(&node->lock);
+            return existing;
+        }
+        if (scan->name[0] == 'p')
+            prop = scan;
+    }
+
+    /* Prefer the lowest free handle. The hint only moves backwards when a handle is
+     * released, so the forward scan here is amortized O(1) per allocation. The handle is
+     * claimed in the table straight away so concurrent callers can't pick the same one.
+     */
+    LOCK(&state->lock);
+    uint32_t handle = state->handle_free_hint == 0 ? 1 : state->handle_free_hint;
+    while (handle != 0xFFFFFFFF && find_phandle_slot(state, handle) != NULL)
+        handle++;
+    bool claimed = false;
+    if (handle != 0xFFFFFFFF && ((state->handle_count + 1) * 2 <= state->handle_capacity || grow_phandle_table()))
+    {
+        store_phandle_slot(handle, node);
+        state->handle_free_hint = handle + 1;
+        if (handle > state->handle_max)
+            state->handle_max = handle;
+        claimed = true;
+    }
+    UNLOCK(&state->lock);
+
+    if (!claimed)
+    {
+        UNLOCK(&node->lock);
+        LOG_ERROR("No free phandles left.");
+        return 0;
+    }
+
+    if (prop == NULL)
+        prop = create_prop_internal(node, "phandle");
+    if (prop == NULL || !ensure_prop_has_buffer_for(prop, FDT_CELL_SIZE))
+    {
+        remove_phandle(handle, node);
+        UNLOCK(&node->lock);
+        return 0;
+    }
+    *(uint32_t*)prop->data = be32(handle);
+    UNLOCK(&node->lock);
+    return handle;
+}
+
+bool dtb_write_prop_string(dtb_prop* prop, const char* str, size_t str_len)
+{
+    if (prop == NULL)
+        return false;
+
+    LOCK(&prop->node->lock);
+    if (!ensure_prop_has_buffer_for(prop, str_len))
+    {
+        UNLOCK(&prop->node->lock);
+        return false;
+    }
+
+    memcpy(prop->data, str, str_len);
+    check_for_special_prop(prop->node, prop);
+    UNLOCK(&prop->node->lock);
+    return true;
+}
+
+bool dtb_write_prop_borrowed(dtb_prop* prop, const void* data, size_t length)
+{
+    if (prop == NULL)
+        return false;
+    if (data == NULL && length != 0)
+        return false;
+    if ((uintptr_t)data & 0b11)
+    {
+        LOG_ERROR("Borrowed property data must be aligned to a cell boundary.");
+        return false;
+    }
+
+    LOCK(&prop->node->lock);
+    if (!log_undo(UNDO_DATA_CHANGED, prop->node, prop))
+    {
+        UNLOCK(&prop->node->lock);
+        return false;
+    }
+
+    if (is_phandle_name(prop->name))
+        remove_phandle(read_phandle_value(prop), prop->node);
+    if (strings_eq(prop->name, "compatible", sizeof("compatible")))
+        index_compat_changed(prop->node, false);
+    if (prop->dataFromMalloc && !is_logging_undo())
+        try_free(prop->data, prop->length);
+
+    /* The data is referenced as-is, the caller must keep it alive (and in big-endian
+     * form) until the property is rewritten or destroyed. */
+    prop->data = (void*)data;
+    prop->length = length;
+    prop->dataFromMalloc = false;
+
+    check_for_special_prop(prop->node, prop);
+    UNLOCK(&prop->node->lock);
+    return true;
+}
+
+static void pack_cells(uint32_t* dest, uintmax_t value, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const size_t shift = (count - 1 - i) * 32;
+        dest[i] = shift < sizeof(uintmax_t) * 8 ? be32((uint32_t)(value >> shift)) : 0;
+    }
+}
+
+/* Specialised kernels for the common case of every field being 1 or 2 cells wide.
+ * They have no data-dependent branches, so the compiler is able to vectorize the
+ * byte-swapping for large tables (reg, ranges, interrupt-map).
+ */
+static void pack_1_cell_values(uint32_t* dest, const uintmax_t* vals, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dest[i] = be32((uint32_t)vals[i]);
+}
+
+static void pack_2_cell_values(uint32_t* dest, const uintmax_t* vals, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        dest[i * 2] = be32((uint32_t)((uint64_t)vals[i] >> 32));
+        dest[i * 2 + 1] = be32((uint32_t)vals[i]);
+    }
+}
+
+/* Packs `count` entries, each made of `field_count` values, into the property. The values
+ * are read from a flat array (the dtb_pair/triplet/quad structs only contain uintmax_t fields),
+ * and each field is split into the number of cells specified by the matching layout entry.
+ */
+static bool write_prop_fields(dtb_prop* prop, size_t count, const size_t* layout, size_t field_count, const uintmax_t* vals)
+{
+    if (prop == NULL)
+        return false;
+    if (vals == NULL && count != 0)
+        return false;
+
+    size_t stride = 0;
+    bool uniform = true;
+    for (size_t i = 0; i < field_count; i++)
+    {
+        if (layout[i] == 0)
+            return false;
+        stride += layout[i];
+        uniform = uniform && layout[i] == layout[0];
+    }
+
+    /* size the output once for the whole table */
+    LOCK(&prop->node->lock);
+    if (!ensure_prop_has_buffer_for(prop, count * stride * FDT_CELL_SIZE))
+    {
+        UNLOCK(&prop->node->lock);
+        return false;
+    }
+
+    uint32_t* dest = prop->data;
+    if (uniform && layout[0] == 1)
+        pack_1_cell_values(dest, vals, count * field_count);
+    else if (uniform && layout[0] == 2)
+        pack_2_cell_values(dest, vals, count * field_count);
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            for (size_t f = 0; f < field_count; f++)
+            {
+                pack_cells(dest, vals[i * field_count + f], layout[f]);
+                dest += layout[f];
+            }
+        }
+    }
+
+    check_for_special_prop(prop->node, prop);
+    UNLOCK(&prop->node->lock);
+    return true;
+}
+
+bool dtb_write_prop_1(dtb_prop* prop, size_t count, size_t cell_count, const uintmax_t* vals)
+{
+    const size_t layout[] = { cell_count };
+    return write_prop_fields(prop, count, layout, 1, vals);
+}
+
+bool dtb_write_prop_2(dtb_prop* prop, size_t count, dtb_pair layout, const dtb_pair* vals)
+{
+    const size_t cells[] = { layout.a, layout.b };
+    return write_prop_fields(prop, count, cells, 2, (const uintmax_t*)vals);
+}
+
+bool dtb_write_prop_3(dtb_prop* prop, size_t count, dtb_triplet layout, const dtb_triplet* vals)
+{
+    const size_t cells[] = { layout.a, layout.b, layout.c };
+    return write_prop_fields(prop, count, cells, 3, (const uintmax_t*)vals);
+}
+
+bool dtb_write_prop_4(dtb_prop* prop, size_t count, dtb_quad layout, const dtb_quad* vals)
+{
+    const size_t cells[] = { layout.a, layout.b, layout.c, layout.d };
+    return write_prop_fields(prop, count, cells, 4, (const uintmax_t*)vals);
+}
+
+static bool compatible_list_matches(const char* const* list, dtb_node* node)
+{
+    if (list == NULL)
+        return false;
+
+    for (size_t i = 0; list[i] != NULL; i++)
+    {
+        if (dtb_is_compatible(node, list[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/* Unlike find_child_internal() this always compares the full name, so "cpu" won't match "cpu@0". */
+static dtb_node* find_child_exact(dtb_node* parent, const char* name, size_t name_len)
+{
+    for (dtb_node* child = parent->child; child != NULL; child = child->sibling)
+    {
+        if (child->name != NULL && string_len(child->name) == name_len && strings_eq(child->name, name, name_len))
+            return child;
+    }
+    return NULL;
+}
+
+/* Source nodes are only created in the destination tree once we know they're needed,
+ * which (when using allow lists) might not be until a descendant is found to be allowed.
+ * Each level of the walk has a frame linking it to its parent.
+ */
+struct copy_frame
+{
+    struct copy_frame* parent;
+    dtb_node* src;
+    dtb_node* dest;
+};
+
+struct copy_data
+{
+    const dtb_copy_filter* filter;
+    char* path;
+    size_t path_len;
+    size_t path_capacity;
+    bool success;
+};
+
+/* The copied values are carved out of one allocation per node, sized for the source values
+ * and owned by the destination context. A rewritten value that no longer fits gets its own buffer.
+ */
+static bool copy_filtered_props(struct copy_data* data, dtb_node* src, dtb_node* dest)
+{
+    const dtb_copy_filter* filter = data->filter;
+    size_t pool_size = 0;
+    for (dtb_prop* prop = src->props; prop != NULL; prop = prop->next)
+    {
+        if (!glob_list_matches(filter->deny_props, prop->name))
+            pool_size += dtb_align_up(prop->length, FDT_CELL_SIZE);
+    }
+
+    uint8_t* pool = NULL;
+    if (pool_size != 0)
+    {
+        pool = alloc_chunk(state, pool_size);
+        if (pool == NULL)
+        {
+            LOG_ERROR("Failed to allocate copied property data.");
+            return false;
+        }
+    }
+
+    size_t pool_used = 0;
+    for (dtb_prop* prop = src->props; prop != NULL; prop = prop->next)
+    {
+        if (glob_list_matches(filter->deny_props, prop->name))
+            continue;
+
+        const void* prop_data = prop->data;
+        size_t prop_len = prop->length;
+        if (filter->rewrite_prop != NULL && !filter->rewrite_prop(src, prop, &prop_data, &prop_len, filter->opaque))
+            continue;
+
+        dtb_prop* copy = dtb_find_or_create_prop(dest, prop->name);
+        if (copy == NULL)
+            return false;
+
+        const size_t slot_len = dtb_align_up(prop_len, FDT_CELL_SIZE);
+        if (pool_used + slot_len <= pool_size)
+        {
+            memcpy(pool + pool_used, prop_data, prop_len);
+            if (!dtb_write_prop_borrowed(copy, pool + pool_used, prop_len))
+                return false;
+            pool_used += slot_len;
+        }
+        else if (!dtb_write_prop_string(copy, prop_data, prop_len))
+            return false;
+    }
+
+    return true;
+}
+
+static dtb_node* materialize_copy(struct copy_data* data, struct copy_frame* frame)
+{
+    if (frame->dest != NULL || !data->success)
+        return frame->dest;
+
+    if (frame->parent == NULL)
+        frame->dest = dtb_find_or_create_node("/");
+    else
+    {
+        dtb_node* parent = materialize_copy(data, frame->parent);
+        if (parent != NULL)
+        {
+            const char* name = frame->src->name;
+            frame->dest = find_child_exact(parent, name, name == NULL ? 0 : string_len(name));
+            if (frame->dest == NULL)
+                frame->dest = dtb_create_child(parent, frame->src->name);
+        }
+    }
+
+    if (frame->dest == NULL || !copy_filtered_props(data, frame->src, frame->dest))
+    {
+        data->success = false;
+        return NULL;
+    }
+    return frame->dest;
+}
+
+static bool push_path_segment(struct copy_data* data, const char* name)
+{
+    const size_t name_len = name == NULL ? 0 : string_len(name);
+    const size_t needed = data->path_len + name_len + 2; /* +1 for separator, +1 for null terminator */
+    if (needed > data->path_capacity)
+    {
+        size_t new_capacity = data->path_capacity == 0 ? 64 : data->path_capacity;
+        while (new_capacity < needed)
+            new_capacity *= 2;
+
+        char* new_path = try_malloc(new_capacity);
+        if (new_path == NULL)
+            return false;
+        memcpy(new_path, data->path, data->path_len);
+        if (data->path != NULL)
+            try_free(data->path, data->path_capacity);
+        data->path = new_path;
+        data->path_capacity = new_capacity;
+    }
+
+    if (data->path_len == 0 || data->path[data->path_len - 1] != '/')
+        data->path[data->path_len++] = '/';
+    memcpy(data->path + data->path_len, name, name_len);
+    data->path_len += name_len;
+    data->path[data->path_len] = 0;
+    return true;
+}
+
+static void copy_filtered_node(struct copy_data* data, struct copy_frame* parent_frame, dtb_node* src, bool allowed)
+{
+    const dtb_copy_filter* filter = data->filter;
+    const size_t prev_path_len = data->path_len;
+    if (!push_path_segment(data, src->name))
+    {
+        data->success = false;
+        return;
+    }
+
+    bool skip = compatible_list_matches(filter->deny_compatible, src)
+        || glob_list_matches(filter->deny_paths, data->path)
+        || (filter->filter_node != NULL && !filter->filter_node(src, filter->opaque));
+
+    if (!skip)
+    {
+        allowed = allowed || compatible_list_matches(filter->allow_compatible, src)
+            || glob_list_matches(filter->allow_paths, data->path);
+
+        struct copy_frame frame;
+        frame.parent = parent_frame;
+        frame.src = src;
+        frame.dest = NULL;
+        if (allowed)
+            materialize_copy(data, &frame);
+
+        for (dtb_node* child = src->child; child != NULL && data->success; child = child->sibling)
+            copy_filtered_node(data, &frame, child, allowed);
+    }
+
+    data->path_len = prev_path_len;
+    if (data->path != NULL)
+        data->path[prev_path_len] = 0;
+}
+
+/* Walks down from the root to `src`, so that ancestors of `src` have frames and can be
+ * created in the destination tree (with their properties) if anything below them is copied.
+ */
+static void copy_filtered_ancestry(struct copy_data* data, struct copy_frame* parent_frame, dtb_node* src, size_t level, size_t src_level, bool allowed)
+{
+    if (level == src_level)
+    {
+        copy_filtered_node(data, parent_frame, src, allowed);
+        return;
+    }
+
+    dtb_node* node = src;
+    for (size_t i = level; i < src_level; i++)
+        node = node->parent;
+
+    const size_t prev_path_len = data->path_len;
+    if (!push_path_segment(data, node->name))
+    {
+        data->success = false;
+        return;
+    }
+
+    struct copy_frame frame;
+    frame.parent = parent_frame;
+    frame.src = node;
+    frame.dest = NULL;
+    copy_filtered_ancestry(data, &frame, src, level + 1, src_level, allowed);
+
+    data->path_len = prev_path_len;
+    data->path[prev_path_len] = 0;
+}
+
+bool dtb_copy_filtered(dtb_node* src, const dtb_copy_filter* filter)
+{
+    if (src == NULL || filter == NULL)
+        return false;
+
+    struct copy_data data;
+    data.filter = filter;
+    data.path = NULL;
+    data.path_len = 0;
+    data.path_capacity = 0;
+    data.success = true;
+
+    /* without any allow rules, everything that isn't denied is copied */
+    const bool allow_all = filter->allow_compatible == NULL && filter->allow_paths == NULL;
+    size_t src_level = 0;
+    for (dtb_node* scan = src->parent; scan != NULL; scan = scan->parent)
+        src_level++;
+    copy_filtered_ancestry(&data, NULL, src, 0, src_level, allow_all);
+
+    if (data.path != NULL)
+        try_free(data.path, data.path_capacity);
+    return data.success;
+}
+
+size_t dtb_copy_filtered_to_buffer(dtb_node* src, const dtb_copy_filter* filter, void* buffer, size_t buffer_size, uint32_t boot_cpu_id)
+{
+    if (src == NULL || filter == NULL)
+        return SMOLDTB_FINALISE_FAILURE;
+
+    dtb_ctx* scratch = dtb_ctx_create(state->ops);
+    if (scratch == NULL)
+    {
+        LOG_ERROR("Failed to create scratch context for filtered copy.");
+        return SMOLDTB_FINALISE_FAILURE;
+    }
+
+    dtb_ctx* prev = swap_state(scratch);
+    size_t result = SMOLDTB_FINALISE_FAILURE;
+    if (dtb_copy_filtered(src, filter))
+        result = dtb_finalise_to_buffer(buffer, buffer_size, boot_cpu_id);
+
+    swap_state(prev);
+    dtb_ctx_destroy(scratch);
+    return result;
+}
+
+struct clone_size
+{
+    size_t nodes;
+    size_t props;
+    size_t handles;
+    size_t data_bytes;
+    size_t name_bytes;
+};
+
+static void measure_clone(dtb_node* node, struct clone_size* size)
+{
+    size->nodes++;
+    if (node->name != NULL)
+        size->name_bytes += string_len(node->name) + 1;
+
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+    {
+        size->props++;
+        size->name_bytes += string_len(prop->name) + 1;
+        size->data_bytes += (prop->length + 3) & ~(size_t)3; /* keep data cell-aligned */
+        if (is_phandle_name(prop->name))
+            size->handles++;
+    }
+
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+        measure_clone(child, size);
+}
+
+/* Everything for the clone has already been allocated as part of the arena, so this
+ * only has to bump through it. Returns the new copy of `src`.
+ */
+static dtb_node* clone_node(dtb_node* src, dtb_node* parent, uint8_t** data, char** names)
+{
+    dtb_node* node = alloc_node();
+    node->parent = parent;
+    node->child = NULL;
+    node->props = NULL;
+    node->fromMalloc = false;
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+    node->lock = 0;
+#endif
+    node->name = NULL;
+    if (src->name != NULL)
+    {
+        const size_t name_len = string_len(src->name) + 1;
+        memcpy(*names, src->name, name_len);
+        node->name = *names;
+        *names += name_len;
+    }
+
+    dtb_prop* last_prop = NULL;
+    for (dtb_prop* src_prop = src->props; src_prop != NULL; src_prop = src_prop->next)
+    {
+        dtb_prop* prop = alloc_prop();
+        prop->fromMalloc = false;
+        prop->dataFromMalloc = false;
+        prop->length = src_prop->length;
+
+        const size_t name_len = string_len(src_prop->name) + 1;
+        memcpy(*names, src_prop->name, name_len);
+        prop->name = *names;
+        *names += name_len;
+
+        prop->data = NULL;
+        if (src_prop->length > 0)
+        {
+            memcpy(*data, src_prop->data, src_prop->length);
+            prop->data = *data;
+            *data += (src_prop->length + 3) & ~(size_t)3;
+        }
+
+        link_prop(node, last_prop, prop);
+        check_for_special_prop(node, prop);
+        last_prop = prop;
+    }
+
+    dtb_node* last_child = NULL;
+    for (dtb_node* src_child = src->child; src_child != NULL; src_child = src_child->sibling)
+    {
+        dtb_node* child = clone_node(src_child, node, data, names);
+        link_node(node, last_child, child);
+        last_child = child;
+    }
+
+    return node;
+}
+
+dtb_ctx* dtb_clone(dtb_node* node)
+{
+    if (node == NULL)
+        return NULL;
+
+    struct clone_size size = { 0, 0, 0, 0, 0 };
+    measure_clone(node, &size);
+
+    dtb_ctx* ctx = dtb_ctx_create(state->ops);
+    if (ctx == NULL)
+    {
+        LOG_ERROR("Failed to create context for clone.");
+        return NULL;
+    }
+
+    size_t handle_capacity = 8;
+    while (handle_capacity < size.handles * 2)
+        handle_capacity *= 2;
+
+    /* data comes straight after the fixed size records so it stays cell-aligned */
+    size_t total_size = size.nodes * sizeof(dtb_node);
+    total_size += size.props * sizeof(dtb_prop);
+    total_size += handle_capacity * sizeof(struct dtb_handle_slot);
+    const size_t data_offset = total_size;
+    total_size += size.data_bytes + size.name_bytes;
+
+    uint8_t* buffer = try_malloc(total_size);
+    if (buffer == NULL)
+    {
+        LOG_ERROR("Failed to allocate clone arena.");
+        dtb_ctx_destroy(ctx);
+        return NULL;
+    }
+
+    ctx->arena_size = total_size;
+    ctx->arenaFromMalloc = true;
+    ctx->node_buff = (dtb_node*)buffer;
+    ctx->node_alloc_max = size.nodes;
+    ctx->prop_buff = (dtb_prop*)&ctx->node_buff[size.nodes];
+    ctx->prop_alloc_max = size.props;
+    ctx->handle_lookup = (struct dtb_handle_slot*)&ctx->prop_buff[size.props];
+    ctx->handle_capacity = handle_capacity;
+    ctx->handle_free_hint = 1;
+    for (size_t i = 0; i < handle_capacity; i++)
+        ctx->handle_lookup[i].node = NULL;
+
+    uint8_t* data = buffer + data_offset;
+    char* names = (char*)(data + size.data_bytes);
+
+    dtb_ctx* prev = swap_state(ctx);
+    dtb_node* root = clone_node(node, NULL, &data, &names);
+    link_node(NULL, NULL, root);
+    swap_state(prev);
+
+    return ctx;
+}
+
+/* Returns the next segment of a path (skipping any leading separators), or a length
+ * of 0 when there are none left.
+ */
+static const char* next_path_segment(const char* path, size_t* seg_len)
+{
+    while (*path == '/')
+        path++;
+
+    *seg_len = 0;
+    while (path[*seg_len] != 0 && path[*seg_len] != '/')
+        (*seg_len)++;
+    return path;
+}
+
+static size_t count_path_segments(const char* path)
+{
+    size_t count = 0;
+    size_t seg_len;
+    for (path = next_path_segment(path, &seg_len); seg_len != 0; path = next_path_segment(path + seg_len, &seg_len))
+        count++;
+    return count;
+}
+
+/* Number of leading segments two paths have in common. */
+static size_t common_path_segments(const char* a, const char* b)
+{
+    size_t count = 0;
+    size_t a_len;
+    size_t b_len;
+    a = next_path_segment(a, &a_len);
+    b = next_path_segment(b, &b_len);
+    while (a_len != 0 && a_len == b_len && strings_eq(a, b, a_len))
+    {
+        count++;
+        a = next_path_segment(a + a_len, &a_len);
+        b = next_path_segment(b + b_len, &b_len);
+    }
+    return count;
+}
+
+struct intern_entry
+{
+    const char* str;
+    size_t len;
+    char* copy;
+};
+
+struct build_data
+{
+    struct intern_entry* names;
+    size_t names_capacity;
+    size_t name_bytes;
+    size_t data_bytes;
+    size_t nodes;
+    size_t props;
+    dtb_node* node_arena;
+    dtb_prop* prop_arena;
+    char* name_arena;
+    uint8_t* data_arena;
+};
+
+/* Names are deduplicated by content, the returned entry's `copy` field is NULL until
+ * the name has been placed in the arena.
+ */
+static struct intern_entry* intern_name(struct build_data* data, const char* str, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+
+    const size_t mask = data->names_capacity - 1;
+    size_t index = hash & mask;
+    while (data->names[index].str != NULL)
+    {
+        struct intern_entry* entry = &data->names[index];
+        if (entry->len == len && strings_eq(entry->str, str, len))
+            return entry;
+        index = (index + 1) & mask;
+    }
+
+    data->names[index].str = str;
+    data->names[index].len = len;
+    data->names[index].copy = NULL;
+    data->name_bytes += len + 1;
+    return &data->names[index];
+}
+
+static const char* get_interned_name(struct build_data* data, const char* str, size_t len)
+{
+    struct intern_entry* entry = intern_name(data, str, len);
+    if (entry->copy == NULL)
+    {
+        entry->copy = data->name_arena;
+        memcpy(entry->copy, str, len);
+        entry->copy[len] = 0;
+        data->name_arena += len + 1;
+    }
+    return entry->copy;
+}
+
+/* Returns the number of bytes needed by a record's value, or -1ul if the record is invalid. */
+static size_t build_record_size(const dtb_build_record* record)
+{
+    if (record->type != SMOLDTB_BUILD_EMPTY && record->data == NULL)
+        return -1ul;
+
+    switch (record->type)
+    {
+    case SMOLDTB_BUILD_EMPTY:
+        return 0;
+    case SMOLDTB_BUILD_U32:
+        return record->count * sizeof(uint32_t);
+    case SMOLDTB_BUILD_U64:
+        return record->count * sizeof(uint64_t);
+    case SMOLDTB_BUILD_STRING:
+        return string_len(record->data) + 1;
+    case SMOLDTB_BUILD_STRINGS:
+    {
+        const char* const* strs = record->data;
+        size_t total = 0;
+        for (size_t i = 0; i < record->count; i++)
+            total += string_len(strs[i]) + 1;
+        return total;
+    }
+    case SMOLDTB_BUILD_BYTES:
+        return record->count;
+    default:
+        return -1ul;
+    }
+}
+
+static void build_record_value(const dtb_build_record* record, uint8_t* dest, size_t length)
+{
+    switch (record->type)
+    {
+    case SMOLDTB_BUILD_U32:
+    {
+        const uint32_t* vals = record->data;
+        uint32_t* cells = (uint32_t*)dest;
+        for (size_t i = 0; i < record->count; i++)
+            cells[i] = be32(vals[i]);
+        break;
+    }
+    case SMOLDTB_BUILD_U64:
+    {
+        const uint64_t* vals = record->data;
+        for (size_t i = 0; i < record->count; i++)
+            pack_cells((uint32_t*)dest + i * 2, vals[i], 2);
+        break;
+    }
+    case SMOLDTB_BUILD_STRINGS:
+    {
+        const char* const* strs = record->data;
+        for (size_t i = 0; i < record->count; i++)
+        {
+            const size_t len = string_len(strs[i]) + 1;
+            memcpy(dest, strs[i], len);
+            dest += len;
+        }
+        break;
+    }
+    case SMOLDTB_BUILD_STRING:
+    case SMOLDTB_BUILD_BYTES:
+        memcpy(dest, record->data, length);
+        break;
+    }
+}
+
+/* Moves from the node at `prev_path` to the node at `path`, creating any missing nodes on the
+ * way down. Only the segments that differ between the two paths are visited, so sorted
+ * records only create (and search for) each node once.
+ */
+static dtb_node* build_walk_to(struct build_data* data, dtb_node* node, const char* prev_path, const char* path)
+{
+    const size_t common = common_path_segments(prev_path, path);
+    for (size_t depth = count_path_segments(prev_path); depth > common; depth--)
+        node = node->parent;
+
+    size_t seg_len;
+    const char* seg = next_path_segment(path, &seg_len);
+    for (size_t i = 0; i < common; i++)
+        seg = next_path_segment(seg + seg_len, &seg_len);
+
+    for (; seg_len != 0; seg = next_path_segment(seg + seg_len, &seg_len))
+    {
+        LOCK(&node->lock);
+        dtb_node* child = find_child_exact(node, seg, seg_len);
+        if (child == NULL)
+        {
+            child = data->node_arena++;
+            child->name = get_interned_name(data, seg, seg_len);
+            child->child = NULL;
+            child->props = NULL;
+            child->ref_slot = 0;
+            child->fromMalloc = false;
+#ifdef SMOLDTB_ENABLE_CONCURRENT_WRITES
+            child->lock = 0;
+#endif
+            link_node(node, NULL, child);
+            log_undo(UNDO_NODE_CREATED, child, NULL);
+        }
+        UNLOCK(&node->lock);
+        node = child;
+    }
+
+    return node;
+}
+
+static void build_prop(struct build_data* data, dtb_node* node, const dtb_build_record* record)
+{
+    const size_t name_len = string_len(record->name);
+    const size_t length = build_record_size(record);
+
+    /* space in the undo log (if needed) was reserved by dtb_build(), so logging can't fail */
+    LOCK(&node->lock);
+    dtb_prop* prop = dtb_find_prop(node, record->name);
+    if (prop != NULL)
     {
-        dtb_node* prime = node->parent->child;
-        while (prime != NULL)
+        log_undo(UNDO_DATA_CHANGED, node, prop);
+        if (is_phandle_name(prop->name))
+            remove_phandle(read_phandle_value(prop), node);
+        if (strings_eq(prop->name, "compatible", sizeof("compatible")))
+            index_compat_changed(node, false);
+        if (prop->dataFromMalloc && !is_logging_undo())
+            try_free(prop->data, prop->length);
+    }
+    else
+    {
+        prop = data->prop_arena++;
+        prop->name = get_interned_name(data, record->name, name_len);
+        prop->ref_slot = 0;
+        prop->fromMalloc = false;
+        link_prop(node, NULL, prop);
+        log_undo(UNDO_PROP_CREATED, node, prop);
+    }
+
+    prop->data = NULL;
+    prop->length = length;
+    prop->dataFromMalloc = false;
+    if (length > 0)
+    {
+        prop->data = data->data_arena;
+        build_record_value(record, data->data_arena, length);
+        data->data_arena += (length + 3) & ~(size_t)3;
+    }
+
+    check_for_special_prop(node, prop);
+    UNLOCK(&node->lock);
+}
+
+bool dtb_build(const dtb_build_record* records, size_t count)
+{
+    if (records == NULL)
+        return false;
+
+    /* Validate everything and get an upper bound on the number of names, so nothing is
+     * modified unless the whole table can be applied.
+     */
+    size_t max_names = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (records[i].path == NULL || records[i].path[0] != '/')
         {
-            prime = prime->sibling;
-            stat->sibling_count++;
+            LOG_ERROR("Bulk build record has invalid path.");
+            return false;
+        }
+        if (records[i].name != NULL && build_record_size(&records[i]) == -1ul)
+        {
+            LOG_ERROR("Bulk build record has invalid value.");
+            return false;
+        }
+        max_names += count_path_segments(records[i].path) + 1;
+    }
+
+    struct build_data data;
+    data.names_capacity = 8;
+    while (data.names_capacity < max_names * 2)
+        data.names_capacity *= 2;
+    data.names = try_malloc(data.names_capacity * sizeof(struct intern_entry));
+    if (data.names == NULL)
+    {
+        LOG_ERROR("Failed to allocate name table for bulk build.");
+        return false;
+    }
+    for (size_t i = 0; i < data.names_capacity; i++)
+        data.names[i].str = NULL;
+
+    /* Measure the arena: only path segments that differ from the previous record can
+     * result in new nodes, so this is exact for sorted records building a new tree.
+     */
+    data.name_bytes = data.data_bytes = data.nodes = data.props = 0;
+    const char* prev_path = "/";
+    for (size_t i = 0; i < count; i++)
+    {
+        const char* path = records[i].path;
+        size_t seg_len;
+        const char* seg = next_path_segment(path, &seg_len);
+        const size_t common = common_path_segments(prev_path, path);
+        for (size_t depth = 0; seg_len != 0; depth++, seg = next_path_segment(seg + seg_len, &seg_len))
+        {
+            if (depth < common)
+                continue;
+            data.nodes++;
+            intern_name(&data, seg, seg_len);
         }
+        prev_path = path;
+
+        if (records[i].name == NULL)
+            continue;
+        data.props++;
+        data.data_bytes += (build_record_size(&records[i]) + 3) & ~(size_t)3;
+        intern_name(&data, records[i].name, string_len(records[i].name));
     }
 
+    const size_t chunk_size = sizeof(struct dtb_arena_chunk) + data.nodes * sizeof(dtb_node)
+        + data.props * sizeof(dtb_prop) + data.data_bytes + data.name_bytes;
+    struct dtb_arena_chunk* chunk = try_malloc(chunk_size);
+    dtb_node* node = NULL;
+    LOCK(&state->lock);
+    const bool reserved = reserve_undo_entries(data.nodes + data.props + 1);
+    UNLOCK(&state->lock);
+    if (chunk != NULL && reserved)
+        node = dtb_find_or_create_node("/");
+    if (node == NULL)
+    {
+        LOG_ERROR("Failed to allocate arena for bulk build.");
+        if (chunk != NULL)
+            try_free(chunk, chunk_size);
+        try_free(data.names, data.names_capacity * sizeof(struct intern_entry));
+        return false;
+    }
+    chunk->size = chunk_size;
+    LOCK(&state->lock);
+    chunk->next = state->chunks;
+    state->chunks = chunk;
+    UNLOCK(&state->lock);
+
+    data.node_arena = (dtb_node*)(chunk + 1);
+    data.prop_arena = (dtb_prop*)(data.node_arena + data.nodes);
+    data.data_arena = (uint8_t*)(data.prop_arena + data.props);
+    data.name_arena = (char*)(data.data_arena + data.data_bytes);
+
+    prev_path = "/";
+    for (size_t i = 0; i < count; i++)
+    {
+        node = build_walk_to(&data, node, prev_path, records[i].path);
+        prev_path = records[i].path;
+        if (records[i].name != NULL)
+            build_prop(&data, node, &records[i]);
+    }
+
+    try_free(data.names, data.names_capacity * sizeof(struct intern_entry));
     return true;
 }
 
-bool dtb_stat_prop(dtb_prop* prop, dtb_prop_stat* stat)
+size_t dtb_snapshot()
 {
-    if (prop == NULL || stat == NULL)
+    state->snapshot_count++;
+    if (!log_undo(UNDO_SNAPSHOT, NULL, NULL))
+    {
+        state->snapshot_count--;
+        if (state->snapshot_count == 0)
+            discard_undo_log();
+        return SMOLDTB_SNAPSHOT_FAILURE;
+    }
+
+    return state->undo_count - 1;
+}
+
+static bool is_open_snapshot(size_t snapshot)
+{
+    return state->snapshot_count != 0 && snapshot < state->undo_count
+        && state->undo_log[snapshot].kind == UNDO_SNAPSHOT;
+}
+
+bool dtb_rollback(size_t snapshot)
+{
+    if (!is_open_snapshot(snapshot))
+    {
+        LOG_ERROR("Tried to roll back to an invalid snapshot.");
         return false;
+    }
 
-    stat->name = prop->name;
-    stat->data = prop->data;
-    stat->data_len = prop->length;
+    /* snapshots taken after this one are closed along with it */
+    while (state->undo_count > snapshot)
+    {
+        struct dtb_undo_entry* entry = &state->undo_log[--state->undo_count];
+        if (entry->kind == UNDO_SNAPSHOT)
+            state->snapshot_count--;
+        else
+            undo_entry(entry);
+    }
+
+    if (state->snapshot_count == 0)
+        discard_undo_log();
     return true;
 }
 
-const char* dtb_read_prop_string(dtb_prop* prop, size_t index)
+void dtb_release_snapshot(size_t snapshot)
 {
-    if (prop == NULL)
-        return NULL;
-    
-    const uint8_t* name = (const uint8_t*)prop->data;
-    size_t curr_index = 0;
-    for (size_t scan = 0; scan < prop->length * 4; scan++)
+    if (!is_open_snapshot(snapshot))
     {
-        if (name[scan] == 0)
+        LOG_ERROR("Tried to release an invalid snapshot.");
+        return;
+    }
+
+    state->undo_log[snapshot].kind = UNDO_SNAPSHOT_RELEASED;
+    state->snapshot_count--;
+    if (state->snapshot_count == 0)
+        discard_undo_log();
+}
+#endif /* SMOLDTB_ENABLE_WRITE_API */
+
+/* ---- Section: Tree Diffing ---- */
+
+struct diff_data
+{
+    bool (*emit)(const dtb_diff_op* op, void* opaque);
+    void* opaque;
+    size_t op_count;
+    bool aborted;
+};
+
+static bool node_names_eq(dtb_node* a, dtb_node* b)
+{
+    const size_t a_len = string_len(a->name);
+    if (a_len != string_len(b->name))
+        return false;
+    return strings_eq(a->name, b->name, a_len);
+}
+
+static bool props_eq(dtb_prop* a, dtb_prop* b)
+{
+    if (a->length != b->length)
+        return false;
+    if (a->data == b->data)
+        return true;
+    return memory_eq(a->data, b->data, a->length);
+}
+
+/* Searches a list of siblings for one with the same full name (including the unit address)
+ * as `match`, starting at `hint` (the last match) and working outwards in both directions.
+ * Trees being compared usually have their nodes in the same order (or reversed, when one was
+ * built by prepending copies), so the next match is normally right next to the last one and
+ * matching a whole list stays linear.
+ */
+static dtb_node* find_matching_sibling(dtb_node* first, dtb_node* hint, dtb_node* match)
+{
+    if (hint == NULL)
+        hint = first;
+
+    dtb_node* fwd = hint;
+    dtb_node* back = (hint == NULL) ? NULL : hint->prev;
+    while (fwd != NULL || back != NULL)
+    {
+        if (fwd != NULL)
         {
-            curr_index++;
-            continue;
+            if (node_names_eq(fwd, match))
+                return fwd;
+            fwd = fwd->sibling;
+        }
+        if (back != NULL)
+        {
+            if (node_names_eq(back, match))
+                return back;
+            back = back->prev;
         }
-        if (curr_index == index)
-            return (const char*)&name[scan];
     }
 
     return NULL;
 }
 
-size_t dtb_read_prop_1(dtb_prop* prop, size_t cell_count, uintmax_t* vals)
+/* Same as find_matching_sibling(), but for properties. */
+static dtb_prop* find_matching_prop(dtb_prop* first, dtb_prop* hint, const char* name, size_t name_len)
 {
-    if (prop == NULL || cell_count == 0)
-        return 0;
-    
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t count = be32(fdtprop->length) / (cell_count * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
+    if (hint == NULL)
+        hint = first;
 
-    for (size_t i = 0; i < count; i++)
+    dtb_prop* fwd = hint;
+    dtb_prop* back = (hint == NULL) ? NULL : hint->prev;
+    while (fwd != NULL || back != NULL)
     {
-        const uint32_t* base = prop_cells + i * cell_count;
-        vals[i] = extract_cells(base, cell_count);
+        if (fwd != NULL)
+        {
+            if (string_len(fwd->name) == name_len && strings_eq(fwd->name, name, name_len))
+                return fwd;
+            fwd = fwd->next;
+        }
+        if (back != NULL)
+        {
+            if (string_len(back->name) == name_len && strings_eq(back->name, name, name_len))
+                return back;
+            back = back->prev;
+        }
     }
 
-    return count;
+    return NULL;
 }
 
-size_t dtb_read_prop_2(dtb_prop* prop, dtb_pair layout, dtb_pair* vals)
+static void diff_emit(struct diff_data* data, size_t kind, dtb_node* target, dtb_node* node, dtb_prop* prop)
 {
-    if (prop == NULL || layout.a == 0 || layout.b == 0)
-        return 0;
-    
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t count = be32(fdtprop->length) / ((layout.a + layout.b) * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
+    if (data->aborted)
+        return;
 
-    for (size_t i = 0; i < count; i++)
+    dtb_diff_op op;
+    op.kind = kind;
+    op.target = target;
+    op.node = node;
+    op.prop = prop;
+
+    data->op_count++;
+    if (data->emit != NULL && !data->emit(&op, data->opaque))
+        data->aborted = true;
+}
+
+/* Ops are emitted so that all changes for a single target node are contiguous:
+ * property changes first, then added and removed children, and then we recurse into
+ * any children that exist in both trees.
+ */
+static void diff_nodes(struct diff_data* data, dtb_node* from, dtb_node* to)
+{
+    if (from == to || data->aborted)
+        return;
+
+    size_t from_count = 0;
+    for (dtb_prop* prop = from->props; prop != NULL; prop = prop->next)
+        from_count++;
+
+    size_t matched = 0;
+    dtb_prop* prop_hint = from->props;
+    for (dtb_prop* prop = to->props; prop != NULL; prop = prop->next)
     {
-        const uint32_t* base = prop_cells + i * (layout.a + layout.b);
-        vals[i].a = extract_cells(base, layout.a);
-        vals[i].b = extract_cells(base + layout.a, layout.b);
+        dtb_prop* old = find_matching_prop(from->props, prop_hint, prop->name, string_len(prop->name));
+        if (old != NULL)
+        {
+            matched++;
+            prop_hint = old;
+        }
+        if (old == NULL || !props_eq(old, prop))
+            diff_emit(data, SMOLDTB_DIFF_SET_PROP, from, NULL, prop);
+    }
+
+    if (matched != from_count)
+    {
+        prop_hint = to->props;
+        for (dtb_prop* prop = from->props; prop != NULL; prop = prop->next)
+        {
+            dtb_prop* found = find_matching_prop(to->props, prop_hint, prop->name, string_len(prop->name));
+            if (found == NULL)
+                diff_emit(data, SMOLDTB_DIFF_REMOVE_PROP, from, NULL, prop);
+            else
+                prop_hint = found;
+        }
+    }
+
+    from_count = 0;
+    for (dtb_node* child = from->child; child != NULL; child = child->sibling)
+        from_count++;
+
+    matched = 0;
+    dtb_node* hint = from->child;
+    for (dtb_node* child = to->child; child != NULL; child = child->sibling)
+    {
+        dtb_node* old = find_matching_sibling(from->child, hint, child);
+        if (old == NULL)
+        {
+            diff_emit(data, SMOLDTB_DIFF_ADD_NODE, from, child, NULL);
+            continue;
+        }
+
+        matched++;
+        hint = old;
+    }
+
+    if (matched != from_count)
+    {
+        hint = to->child;
+        for (dtb_node* child = from->child; child != NULL; child = child->sibling)
+        {
+            dtb_node* found = find_matching_sibling(to->child, hint, child);
+            if (found == NULL)
+                diff_emit(data, SMOLDTB_DIFF_REMOVE_NODE, from, child, NULL);
+            else
+                hint = found;
+        }
+    }
+
+    /* nothing left to recurse into */
+    if (matched == 0)
+        return;
+
+    hint = from->child;
+    for (dtb_node* child = to->child; child != NULL; child = child->sibling)
+    {
+        dtb_node* old = find_matching_sibling(from->child, hint, child);
+        if (old == NULL)
+            continue;
+
+        hint = old;
+        diff_nodes(data, old, child);
     }
-    return count;
 }
 
-size_t dtb_read_prop_3(dtb_prop* prop, dtb_triplet layout, dtb_triplet* vals)
+size_t dtb_diff(dtb_node* from, dtb_node* to, bool (*emit)(const dtb_diff_op* op, void* opaque), void* opaque)
 {
-    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0)
+    if (from == NULL || to == NULL)
         return 0;
 
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t stride = layout.a + layout.b + layout.c;
-    const size_t count = be32(fdtprop->length) / (stride * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
+    struct diff_data data;
+    data.emit = emit;
+    data.opaque = opaque;
+    data.op_count = 0;
+    data.aborted = false;
 
-    for (size_t i = 0; i < count; i++)
+    diff_nodes(&data, from, to);
+    return data.op_count;
+}
+
+#ifdef SMOLDTB_ENABLE_WRITE_API
+struct overlay_data
+{
+    dtb_node* last_target;
+    dtb_node* overlay_node;
+    size_t fragment_count;
+    size_t dropped_count;
+    bool success;
+};
+
+/* Writes the path of `node` into `buf` and returns the full length of the path, even if
+ * it was truncated. The output is always null-terminated if buf_len is non-zero.
+ */
+static size_t build_node_path(dtb_node* node, char* buf, size_t buf_len)
+{
+    size_t path_len = 0;
+    for (dtb_node* scan = node; scan != NULL && scan->parent != NULL; scan = scan->parent)
+        path_len += string_len(scan->name) + 1;
+    if (path_len == 0)
+        path_len = 1;
+
+    if (buf_len != 0)
     {
-        const uint32_t* base = prop_cells + i * stride;
-        vals[i].a = extract_cells(base, layout.a);
-        vals[i].b = extract_cells(base + layout.a, layout.b);
-        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
+        size_t end = path_len < buf_len ? path_len : buf_len - 1;
+        buf[end] = 0;
+        buf[0] = '/';
+
+        size_t tail = path_len;
+        for (dtb_node* scan = node; scan != NULL && scan->parent != NULL; scan = scan->parent)
+        {
+            const size_t name_len = string_len(scan->name);
+            tail -= name_len;
+            for (size_t i = 0; i < name_len; i++)
+            {
+                if (tail + i < end)
+                    buf[tail + i] = scan->name[i];
+            }
+
+            tail--;
+            if (tail < end)
+                buf[tail] = '/';
+        }
     }
-    return count;
+
+    return path_len;
 }
 
-size_t dtb_read_prop_4(dtb_prop* prop, dtb_quad layout, dtb_quad* vals)
+static bool copy_prop_into(dtb_node* dest, dtb_prop* prop)
 {
-    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0 || layout.d == 0)
-        return 0;
+    dtb_prop* copy = dtb_find_or_create_prop(dest, prop->name);
+    if (copy == NULL)
+        return false;
+    return dtb_write_prop_string(copy, prop->data, prop->length);
+}
+
+static bool copy_subtree_into(dtb_node* dest_parent, dtb_node* src)
+{
+    dtb_node* copy = dtb_create_child(dest_parent, src->name);
+    if (copy == NULL)
+        return false;
+
+    for (dtb_prop* prop = src->props; prop != NULL; prop = prop->next)
+    {
+        if (!copy_prop_into(copy, prop))
+            return false;
+    }
+    for (dtb_node* child = src->child; child != NULL; child = child->sibling)
+    {
+        if (!copy_subtree_into(copy, child))
+            return false;
+    }
+
+    return true;
+}
+
+static dtb_node* get_overlay_node_for(struct overlay_data* data, dtb_node* target)
+{
+    if (target == data->last_target)
+        return data->overlay_node;
+
+    char name_buf[32] = "fragment@";
+    size_t name_len = 9;
+    char digits[20];
+    size_t digit_count = 0;
+    size_t index = data->fragment_count++;
+    do
+    {
+        digits[digit_count++] = '0' + (index % 10);
+        index /= 10;
+    } while (index != 0);
+    while (digit_count > 0)
+        name_buf[name_len++] = digits[--digit_count];
+    name_buf[name_len] = 0;
+
+    dtb_node* fragment = dtb_create_child(state->root, name_buf);
+    if (fragment == NULL)
+        return NULL;
+
+    const size_t path_len = build_node_path(target, NULL, 0);
+    char* path_buf = try_malloc(path_len + 1);
+    if (path_buf == NULL)
+    {
+        LOG_ERROR("Failed to allocate overlay target path.");
+        dtb_destroy_node(fragment);
+        return NULL;
+    }
+    build_node_path(target, path_buf, path_len + 1);
+
+    dtb_prop* target_path = dtb_create_prop(fragment, "target-path");
+    const bool path_ok = target_path != NULL && dtb_write_prop_string(target_path, path_buf, path_len + 1);
+    try_free(path_buf, path_len + 1);
+    dtb_node* overlay = path_ok ? dtb_create_child(fragment, "__overlay__") : NULL;
+    if (overlay == NULL)
+    {
+        dtb_destroy_node(fragment);
+        return NULL;
+    }
+
+    data->last_target = target;
+    data->overlay_node = overlay;
+    return overlay;
+}
+
+static bool emit_overlay_op(const dtb_diff_op* op, void* opaque)
+{
+    struct overlay_data* data = opaque;
+
+    /* overlays can only add or modify, removals have no representation */
+    if (op->kind == SMOLDTB_DIFF_REMOVE_NODE || op->kind == SMOLDTB_DIFF_REMOVE_PROP)
+    {
+        data->dropped_count++;
+        return true;
+    }
+
+    dtb_node* overlay = get_overlay_node_for(data, op->target);
+    if (overlay == NULL)
+    {
+        data->success = false;
+        return false;
+    }
+
+    if (op->kind == SMOLDTB_DIFF_SET_PROP)
+        data->success = copy_prop_into(overlay, op->prop);
+    else
+        data->success = copy_subtree_into(overlay, op->node);
+    return data->success;
+}
+
+size_t dtb_diff_to_overlay(dtb_node* from, dtb_node* to, void* buffer, size_t buffer_size, size_t* dropped)
+{
+    if (from == NULL || to == NULL)
+        return SMOLDTB_FINALISE_FAILURE;
+
+    dtb_ctx* scratch = dtb_ctx_create(state->ops);
+    if (scratch == NULL)
+    {
+        LOG_ERROR("Failed to create scratch context for overlay.");
+        return SMOLDTB_FINALISE_FAILURE;
+    }
+
+    dtb_ctx* prev = swap_state(scratch);
+    size_t result = SMOLDTB_FINALISE_FAILURE;
 
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t stride = layout.a + layout.b + layout.c + layout.d;
-    const size_t count = be32(fdtprop->length) / (stride * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
+    struct overlay_data data;
+    data.last_target = NULL;
+    data.overlay_node = NULL;
+    data.fragment_count = 0;
+    data.dropped_count = 0;
+    data.success = dtb_find_or_create_node("/") != NULL;
 
-    for (size_t i = 0; i < count; i++)
+    if (data.success)
+        dtb_diff(from, to, emit_overlay_op, &data);
+    if (data.success && data.dropped_count > 0 && dropped == NULL)
     {
-        const uint32_t* base = prop_cells + i * stride;
-        vals[i].a = extract_cells(base, layout.a); 
-        vals[i].b = extract_cells(base + layout.a, layout.b);
-        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
-        vals[i].d = extract_cells(base + layout.a + layout.b + layout.c, layout.d);
+        LOG_ERROR("Diff contains removals, which an overlay can't express.");
+        result = SMOLDTB_OVERLAY_LOSSY;
     }
-    return count;
+    else if (data.success)
+        result = dtb_finalise_to_buffer(buffer, buffer_size, 0);
+    if (dropped != NULL)
+        *dropped = data.dropped_count;
+
+    swap_state(prev);
+    dtb_ctx_destroy(scratch);
+    return result;
 }
+#endif
 
-#ifdef SMOLDTB_ENABLE_WRITE_API
-/* ---- Section: Writable-Mode Private Functions ---- */
+/* ---- Section: Compact Trees ---- */
+
+/* A compact tree is a read-only copy of a (sub)tree in a single buffer. It contains no
+ * pointers so it can be moved, mapped or saved as-is. Integers in node records are LEB128
+ * varints, and offsets are from the start of the buffer. The layout is:
+ * - The header, followed by the offsets of each property name. Names are sorted, and a
+ *   name's ID is its position in the table. Then the name strings.
+ * - The payload pool, holding property values. Each value starts on a 4 byte boundary, like
+ *   in a blob. With SMOLDTB_COMPACT_DEDUP identical values are only stored once.
+ * - Node records: the record size (so a subtree can be skipped in one step), how many bytes
+ *   of the name are shared with the previous sibling, the rest of the name, the property
+ *   count, each property's name ID, length and pool offset, and then the child records.
+ * Nodes and properties are kept in the same order as the tree they were made from.
+ */
+#define COMPACT_MAGIC 0x746d6f73
+#define COMPACT_NAME_MAX 256
 
-struct finalise_data
+struct compact_header
 {
-    uint32_t* struct_buf;
-    char* string_buf;
-    size_t struct_ptr;
-    size_t string_ptr;
-    size_t struct_buf_size;
-    size_t string_buf_size;
-    bool print_success;
+    uint32_t magic;
+    uint32_t total_size;
+    uint32_t name_count;
+    uint32_t pool_offset;
+    uint32_t nodes_offset;
 };
 
-struct name_collision_check
+struct compact_name
 {
-    const char* name;
-    size_t name_len;
-    bool collision;
+    const char* str;
+    size_t id;
 };
 
-static int destroy_props(dtb_node* node, dtb_prop* prop, void* opaque)
+struct compact_payload
 {
-    (void)node;
-    (void)opaque;
-
-    if (prop->dataFromMalloc)
-        try_free(prop->data, prop->length);
-    if (prop->fromMalloc)
-        try_free(prop, sizeof(dtb_prop));
+    const void* data;
+    size_t length;
+    size_t offset;
+};
 
-    return SMOLDTB_FOREACH_CONTINUE;
-}
+struct compact_data
+{
+    struct compact_name* names;
+    size_t names_capacity;
+    size_t name_count;
+    size_t name_bytes;
+    struct compact_payload* payloads;
+    size_t payloads_capacity;
+    size_t pool_size;
+    bool dedup;
+    size_t* record_sizes; /* the size of each node's record, in preorder */
+    size_t node_index;
+    uint8_t* pool;
+    uint8_t* out;
+};
 
-static void destroy_dead_node(dtb_node* node)
+struct compact_record
 {
-    if (node == NULL || node->parent != NULL)
-        return;
+    const uint8_t* suffix;
+    size_t shared;
+    size_t suffix_len;
+    size_t prop_count;
+    const uint8_t* props;
+    size_t end;
+};
 
-    while (node->child != NULL)
+static size_t varint_len(size_t value)
+{
+    size_t len = 1;
+    while (value >= 0x80)
     {
-        dtb_node* deletee = node->child;
-        node->child = node->child->sibling;
-
-        deletee->parent = NULL;
-        destroy_dead_node(deletee);
+        value >>= 7;
+        len++;
     }
-
-    do_foreach_prop(node, destroy_props, NULL);
-    if (node->fromMalloc)
-        try_free(node, sizeof(dtb_node));
+    return len;
 }
 
-static int init_finalise_data_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+static uint8_t* write_varint(uint8_t* out, size_t value)
 {
-    (void)node;
-    if (node == NULL || prop == NULL)
-        return SMOLDTB_FOREACH_CONTINUE;
+    while (value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
 
-    struct finalise_data* data = opaque;
-    data->struct_buf_size += 3; /* +1 for FDT_PROP token, +2 for prop description struct */
-    data->struct_buf_size += dtb_align_up(prop->length, FDT_CELL_SIZE) / FDT_CELL_SIZE;
-    data->string_buf_size += string_len(prop->name) + 1; /* +1 for null terminator */
+static size_t read_varint(const uint8_t** in)
+{
+    size_t value = 0;
+    size_t shift = 0;
+    uint8_t byte;
+    do
+    {
+        byte = *(*in)++;
+        value |= (size_t)(byte & 0x7F) << shift;
+        shift += 7;
+    }
+    while (byte & 0x80);
+    return value;
+}
 
-    return SMOLDTB_FOREACH_CONTINUE;
+static int compare_strings(const char* a, const char* b)
+{
+    while (*a != 0 && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return (int)(uint8_t)*a - (int)(uint8_t)*b;
 }
 
-static int init_finalise_data(dtb_node* node, void* opaque)
+static size_t payload_hash(const void* data, size_t length)
 {
-    if (node == NULL)
-        return SMOLDTB_FOREACH_CONTINUE;
+    const uint8_t* bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
 
-    struct finalise_data* data = opaque;
-    data->struct_buf_size += 2; /* +1 for BEGIN_NODE token, +1 for END_NODE token */
-    data->struct_buf_size += dtb_align_up(string_len(node->name) + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE; /* +1 for null terminator */
+static struct compact_name* find_compact_name(struct compact_data* data, const char* name)
+{
+    const size_t mask = data->names_capacity - 1;
+    size_t slot = compat_hash(name) & mask;
+    while (data->names[slot].str != NULL && compare_strings(data->names[slot].str, name) != 0)
+        slot = (slot + 1) & mask;
+    return &data->names[slot];
+}
 
-    do_foreach_prop(node, init_finalise_data_prop, opaque);
-    do_foreach_sibling(node->child, init_finalise_data, opaque);
+static struct compact_payload* find_compact_payload(struct compact_data* data, dtb_prop* prop)
+{
+    const size_t mask = data->payloads_capacity - 1;
+    size_t slot = payload_hash(prop->data, prop->length) & mask;
+    while (data->payloads[slot].data != NULL)
+    {
+        struct compact_payload* payload = &data->payloads[slot];
+        if (payload->length == prop->length && memory_eq(payload->data, prop->data, prop->length))
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return &data->payloads[slot];
+}
 
-    return SMOLDTB_FOREACH_CONTINUE;
+/* Without dedup each value gets its own space in the pool, handed out in the order the
+ * tree is walked. Both passes walk the tree the same way so they agree on the offsets.
+ */
+static size_t compact_payload_offset(struct compact_data* data, dtb_prop* prop, size_t* next_offset)
+{
+    if (!data->dedup)
+    {
+        const size_t offset = *next_offset;
+        *next_offset += dtb_align_up(prop->length, FDT_CELL_SIZE);
+        return offset;
+    }
+    return find_compact_payload(data, prop)->offset;
 }
 
-static int print_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+static void count_compact_subtree(dtb_node* node, size_t* nodes, size_t* props)
 {
-    (void)node;
-    struct finalise_data* data = opaque;
+    (*nodes)++;
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+        (*props)++;
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+        count_compact_subtree(child, nodes, props);
+}
 
-    const uint32_t name_offset = data->string_ptr;
-    const size_t name_len = string_len(prop->name);
-    if (data->string_ptr + name_len + 1 > data->string_buf_size) /* bounds check */
+/* Gathers the property names, and the unique values if dedup is enabled. */
+static bool collect_compact_node(struct compact_data* data, dtb_node* node)
+{
+    if (string_len(node->name) >= COMPACT_NAME_MAX)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
+        LOG_ERROR("Node name is too long for a compact tree.");
+        return false;
     }
 
-    memcpy(data->string_buf + data->string_ptr, prop->name, name_len);
-    data->string_buf[data->string_ptr + name_len] = 0;
-    data->string_ptr += name_len + 1; /* +1 for null terminator */
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+    {
+        struct compact_name* name = find_compact_name(data, prop->name);
+        if (name->str == NULL)
+        {
+            name->str = prop->name;
+            data->name_count++;
+            data->name_bytes += string_len(prop->name) + 1;
+        }
 
-    const size_t data_cells = dtb_align_up(prop->length, FDT_CELL_SIZE) / FDT_CELL_SIZE;
-    if (data->struct_ptr + 3 + data_cells > data->struct_buf_size) /* bounds check */
+        if (prop->length == 0)
+            continue;
+        if (!data->dedup)
+        {
+            data->pool_size += dtb_align_up(prop->length, FDT_CELL_SIZE);
+            continue;
+        }
+
+        struct compact_payload* payload = find_compact_payload(data, prop);
+        if (payload->data == NULL)
+        {
+            payload->data = prop->data;
+            payload->length = prop->length;
+            payload->offset = data->pool_size;
+            data->pool_size += dtb_align_up(prop->length, FDT_CELL_SIZE);
+        }
+    }
+
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
+        if (!collect_compact_node(data, child))
+            return false;
     }
+    return true;
+}
 
-    data->struct_buf[data->struct_ptr++] = be32(FDT_PROP);
-    data->struct_buf[data->struct_ptr++] = be32((uint32_t)prop->length);
-    data->struct_buf[data->struct_ptr++] = be32(name_offset);
+static size_t shared_name_prefix(dtb_node* prev, dtb_node* node)
+{
+    if (prev == NULL || prev->name == NULL || node->name == NULL)
+        return 0;
 
-    uint32_t* prop_cells = prop->data;
-    for (size_t i = 0; i < data_cells; i++)
-        data->struct_buf[data->struct_ptr++] = prop_cells[i];
+    size_t len = 0;
+    while (node->name[len] != 0 && prev->name[len] == node->name[len])
+        len++;
+    return len;
+}
 
-    return SMOLDTB_FOREACH_CONTINUE;
+static size_t count_props(dtb_node* node)
+{
+    size_t count = 0;
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+        count++;
+    return count;
 }
 
-static int print_node(dtb_node* node, void* opaque)
+/* Returns the size of a node's record, not counting the size field at the start of it. The
+ * size comes first, so every record is measured (once, bottom up) before any are written.
+ */
+static size_t measure_compact_node(struct compact_data* data, dtb_node* prev, dtb_node* node, size_t* next_offset)
 {
-    struct finalise_data* data = opaque;
-    const size_t name_len = string_len(node->name);
-    const size_t name_cells = dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+    const size_t index = data->node_index++;
+    const size_t shared = shared_name_prefix(prev, node);
+    const size_t suffix_len = string_len(node->name) - shared;
 
-    if (data->struct_ptr + 1 + name_cells > data->struct_buf_size) /* bounds check */
+    size_t size = varint_len(shared) + varint_len(suffix_len) + suffix_len + varint_len(count_props(node));
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
+        size += varint_len(find_compact_name(data, prop->name)->id) + varint_len(prop->length);
+        if (prop->length != 0)
+            size += varint_len(compact_payload_offset(data, prop, next_offset));
     }
 
-    data->struct_buf[data->struct_ptr++] = be32(FDT_BEGIN_NODE);
+    dtb_node* child_prev = NULL;
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+    {
+        const size_t child_size = measure_compact_node(data, child_prev, child, next_offset);
+        size += varint_len(child_size) + child_size;
+        child_prev = child;
+    }
 
-    uint8_t* name_buf = (uint8_t*)(data->struct_buf + data->struct_ptr);
-    memcpy(name_buf, node->name, name_len);
-    name_buf[name_len] = 0;
-    data->struct_ptr += name_cells;
+    data->record_sizes[index] = size;
+    return size;
+}
 
-    do_foreach_prop(node, print_prop, opaque);
-    if (!data->print_success)
-        return SMOLDTB_FOREACH_ABORT;
-    do_foreach_sibling(node->child, print_node, opaque);
-    if (!data->print_success)
-        return SMOLDTB_FOREACH_ABORT;
+/* Writes a node's record at `data->out` (using the size from measuring it) and moves
+ * `data->out` past it.
+ */
+static void emit_compact_node(struct compact_data* data, dtb_node* prev, dtb_node* node, size_t* next_offset)
+{
+    const size_t shared = shared_name_prefix(prev, node);
+    const size_t suffix_len = string_len(node->name) - shared;
+
+    uint8_t* out = data->out;
+    out = write_varint(out, data->record_sizes[data->node_index++]);
+    out = write_varint(out, shared);
+    out = write_varint(out, suffix_len);
+    memcpy(out, node->name + shared, suffix_len);
+    out = write_varint(out + suffix_len, count_props(node));
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+    {
+        out = write_varint(out, find_compact_name(data, prop->name)->id);
+        out = write_varint(out, prop->length);
+        if (prop->length == 0)
+            continue;
 
-    if (data->struct_ptr + 1 > data->struct_buf_size) /* bounds check */
+        const size_t offset = compact_payload_offset(data, prop, next_offset);
+        out = write_varint(out, offset);
+        memcpy(data->pool + offset, prop->data, prop->length);
+        for (size_t i = prop->length; i < dtb_align_up(prop->length, FDT_CELL_SIZE); i++)
+            data->pool[offset + i] = 0;
+    }
+
+    data->out = out;
+    dtb_node* child_prev = NULL;
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
+        emit_compact_node(data, child_prev, child, next_offset);
+        child_prev = child;
     }
-    data->struct_buf[data->struct_ptr++] = be32(FDT_END_NODE);
+}
 
-    return SMOLDTB_FOREACH_CONTINUE;
+static void sift_compact_name(const char** names, size_t root, size_t count)
+{
+    while (root * 2 + 1 < count)
+    {
+        size_t child = root * 2 + 1;
+        if (child + 1 < count && compare_strings(names[child + 1], names[child]) > 0)
+            child++;
+        if (compare_strings(names[root], names[child]) >= 0)
+            return;
+
+        const char* swap = names[root];
+        names[root] = names[child];
+        names[child] = swap;
+        root = child;
+    }
 }
 
-static int check_sibling_name_collisions(dtb_node* node, void* opaque)
+/* Sorts the collected names and assigns their IDs, then writes the name table. The sorted
+ * list is built in `sorted`, which must have space for every name. A heap sort is used since
+ * it needs no extra memory.
+ */
+static void write_compact_names(struct compact_data* data, const char** sorted, uint8_t* buffer)
 {
-    struct name_collision_check* check = opaque;
+    size_t count = 0;
+    for (size_t i = 0; i < data->names_capacity; i++)
+    {
+        if (data->names[i].str != NULL)
+            sorted[count++] = data->names[i].str;
+    }
 
-    if (!strings_eq(node->name, check->name, check->name_len))
-        return SMOLDTB_FOREACH_CONTINUE;
+    for (size_t i = count / 2; i > 0; i--)
+        sift_compact_name(sorted, i - 1, count);
+    for (size_t i = count; i > 1; i--)
+    {
+        const char* largest = sorted[0];
+        sorted[0] = sorted[i - 1];
+        sorted[i - 1] = largest;
+        sift_compact_name(sorted, 0, i - 1);
+    }
 
-    check->collision = true;
-    return SMOLDTB_FOREACH_ABORT;
+    size_t str_offset = sizeof(struct compact_header) + count * sizeof(uint32_t);
+    for (size_t i = 0; i < count; i++)
+    {
+        find_compact_name(data, sorted[i])->id = i;
+        if (buffer == NULL)
+            continue;
+
+        const size_t len = string_len(sorted[i]) + 1;
+        uint32_t* table = (uint32_t*)(buffer + sizeof(struct compact_header));
+        table[i] = str_offset;
+        memcpy(buffer + str_offset, sorted[i], len);
+        str_offset += len;
+    }
 }
 
-static int check_prop_name_collisions(dtb_node* node, dtb_prop* prop, void* opaque)
+size_t dtb_compact(dtb_node* root, void* buffer, size_t buffer_size, size_t flags)
 {
-    (void)node;
-    struct name_collision_check* check = opaque;
+    if (root == NULL)
+        return SMOLDTB_COMPACT_FAILURE;
+
+    size_t node_count = 0;
+    size_t prop_count = 0;
+    count_compact_subtree(root, &node_count, &prop_count);
+    size_t capacity = 8;
+    while (capacity < prop_count * 2)
+        capacity *= 2;
+
+    struct compact_data data;
+    data.names_capacity = capacity;
+    data.name_count = 0;
+    data.name_bytes = 0;
+    data.payloads_capacity = capacity;
+    data.pool_size = 0;
+    data.dedup = (flags & SMOLDTB_COMPACT_DEDUP) != 0;
+    data.pool = NULL;
+    data.out = NULL;
+
+    /* the record sizes go first, then the hash tables. The sorted name list goes at the end,
+     * and can use at most one entry per table slot */
+    const size_t scratch_size = node_count * sizeof(size_t)
+        + capacity * (sizeof(struct compact_name) + sizeof(const char*))
+        + (data.dedup ? capacity * sizeof(struct compact_payload) : 0);
+    uint8_t* scratch = try_malloc(scratch_size);
+    if (scratch == NULL)
+        return SMOLDTB_COMPACT_FAILURE;
+
+    data.record_sizes = (size_t*)scratch;
+    data.names = (struct compact_name*)(data.record_sizes + node_count);
+    data.payloads = (struct compact_payload*)(data.names + capacity);
+    const char** sorted = (const char**)(data.dedup ? (uint8_t*)(data.payloads + capacity) : (uint8_t*)data.payloads);
+    for (size_t i = 0; i < capacity; i++)
+    {
+        data.names[i].str = NULL;
+        if (data.dedup)
+            data.payloads[i].data = NULL;
+    }
 
-    if (!strings_eq(prop->name, check->name, check->name_len))
-        return SMOLDTB_FOREACH_CONTINUE;
+    size_t result = SMOLDTB_COMPACT_FAILURE;
+    if (!collect_compact_node(&data, root))
+        goto cleanup;
+
+    write_compact_names(&data, sorted, NULL);
+    const size_t names_end = sizeof(struct compact_header) + data.name_count * sizeof(uint32_t)
+        + data.name_bytes;
+    const size_t pool_offset = dtb_align_up(names_end, FDT_CELL_SIZE);
+    const size_t nodes_offset = pool_offset + data.pool_size;
+    size_t next_offset = 0;
+    data.node_index = 0;
+    const size_t root_size = measure_compact_node(&data, NULL, root, &next_offset);
+    const size_t total_size = nodes_offset + varint_len(root_size) + root_size;
+    if (total_size > (uint32_t)-1)
+    {
+        LOG_ERROR("Tree is too large to compact.");
+        goto cleanup;
+    }
 
-    check->collision = true;
-    return SMOLDTB_FOREACH_ABORT;
+    result = total_size;
+    if (buffer == NULL || buffer_size < total_size)
+        goto cleanup;
+
+    uint8_t* base = buffer;
+    struct compact_header* header = buffer;
+    header->magic = COMPACT_MAGIC;
+    header->total_size = total_size;
+    header->name_count = data.name_count;
+    header->pool_offset = pool_offset;
+    header->nodes_offset = nodes_offset;
+    write_compact_names(&data, sorted, base);
+    for (size_t i = names_end; i < pool_offset; i++)
+        base[i] = 0;
+
+    data.pool = base + pool_offset;
+    data.out = base + nodes_offset;
+    next_offset = 0;
+    data.node_index = 0;
+    emit_compact_node(&data, NULL, root, &next_offset);
+
+cleanup:
+    try_free(scratch, scratch_size);
+    return result;
 }
 
-/* ---- Section: Writable-Mode Public API ---- */
-
-size_t dtb_finalise_to_buffer(void* buffer, size_t buffer_size, uint32_t boot_cpu_id)
+static const struct compact_header* compact_header_of(const void* tree)
 {
-    struct finalise_data final_data;
-    final_data.struct_buf_size = 0;
-    final_data.string_buf_size = 1; /* we'll use 1 byte for the empty string */
+    const struct compact_header* header = tree;
+    if (header == NULL || header->magic != COMPACT_MAGIC)
+        return NULL;
+    return header;
+}
 
-    do_foreach_sibling(state.root, init_finalise_data, &final_data);
-    const size_t reserved_block_size = 2 * sizeof(uint64_t);
-    const size_t struct_buf_bytes = final_data.struct_buf_size * FDT_CELL_SIZE;
-    const size_t total_bytes = final_data.string_buf_size + struct_buf_bytes + 
-        sizeof(struct fdt_header) + reserved_block_size;
+static void read_compact_record(const void* tree, size_t offset, struct compact_record* record)
+{
+    const uint8_t* scan = (const uint8_t*)tree + offset;
+    const size_t size = read_varint(&scan);
+    record->end = (size_t)(scan - (const uint8_t*)tree) + size;
+    record->shared = read_varint(&scan);
+    record->suffix_len = read_varint(&scan);
+    record->suffix = scan;
+    scan += record->suffix_len;
+    record->prop_count = read_varint(&scan);
+    record->props = scan;
+}
 
-    if (buffer == NULL || total_bytes < buffer_size)
-        return total_bytes;
-    if ((uintptr_t)buffer & 0b11)
-        return SMOLDTB_FINALISE_FAILURE; /* check buffer is aligned to a 32-bit boundary */
+static size_t compact_first_child(const void* tree, struct compact_record* record)
+{
+    const uint8_t* scan = record->props;
+    for (size_t i = 0; i < record->prop_count; i++)
+    {
+        read_varint(&scan);
+        if (read_varint(&scan) != 0)
+            read_varint(&scan);
+    }
+    return (size_t)(scan - (const uint8_t*)tree);
+}
 
-    struct fdt_header* header = (struct fdt_header*)buffer;
-    header->magic = be32(FDT_MAGIC);
-    header->total_size = be32(total_bytes);
-    header->offset_structs = be32(sizeof(struct fdt_header) + 16); /* size of reserved block */
-    header->offset_strings = be32(be32(header->offset_structs) + struct_buf_bytes);
-    header->offset_memmap_rsvd = be32(sizeof(struct fdt_header));
-    header->version = be32(FDT_VERSION);
-    header->last_comp_version = be32(16); /* as per spec, this field must be 16. */
-    header->boot_cpu_id = be32(boot_cpu_id);
-    header->size_strings = be32(final_data.string_buf_size);
-    header->size_structs = be32(struct_buf_bytes);
+static dtb_cnode make_cnode(size_t offset, size_t parent)
+{
+    dtb_cnode node;
+    node.offset = offset;
+    node.parent = parent;
+    return node;
+}
 
-    /* Apparently the great minds behind the device tree spec were able to think far enough
-     * ahead to include size fields for the string and structure blocks, but not
-     * the reserved memory block. The end of this block is indicated by an entry filled
-     * with zeroes, because a size field would be too easy.
-     * So even though we dont use this block, we must include a single entry for it. */
-    uint64_t* reserved_block = (uint64_t*)(header + 1);
-    reserved_block[0] = 0;
-    reserved_block[1] = 0;
+/* Same rules as find_child_internal(), names are rebuilt from their shared prefixes while
+ * walking the children.
+ */
+static dtb_cnode compact_find_child_internal(const void* tree, dtb_cnode node, const char* name, size_t name_bounds)
+{
+    const size_t at_pos = string_find_char(name, '@');
+    const bool has_addr = at_pos < name_bounds;
 
-    final_data.struct_buf = (uint32_t*)((uintptr_t)buffer + be32(header->offset_structs));
-    final_data.string_buf = (char*)((uintptr_t)buffer + be32(header->offset_strings));
-    final_data.struct_ptr = 0;
-    final_data.string_ptr = 1;
-    final_data.string_buf[0] = 0;
+    struct compact_record record;
+    read_compact_record(tree, node.offset, &record);
+    const size_t end = record.end;
+    size_t offset = compact_first_child(tree, &record);
 
-    final_data.print_success = true;
-    do_foreach_sibling(state.root, print_node, &final_data);
-    return final_data.print_success ? total_bytes : SMOLDTB_FINALISE_FAILURE;
+    char child_name[COMPACT_NAME_MAX];
+    while (offset < end)
+    {
+        read_compact_record(tree, offset, &record);
+        memcpy(child_name + record.shared, record.suffix, record.suffix_len);
+        const size_t full_len = record.shared + record.suffix_len;
+        child_name[full_len] = 0;
+
+        size_t child_name_len = string_find_char(child_name, '@');
+        if (child_name_len == -1ul || has_addr)
+            child_name_len = full_len;
+        if (child_name_len == name_bounds && strings_eq(child_name, name, name_bounds))
+            return make_cnode(offset, node.offset);
+
+        offset = record.end;
+    }
+
+    return make_cnode(0, 0);
 }
 
-dtb_node* dtb_find_or_create_node(const char* path)
+dtb_cnode dtb_compact_root(const void* tree)
 {
-    if (path == NULL)
-        return NULL;
+    const struct compact_header* header = compact_header_of(tree);
+    if (header == NULL)
+        return make_cnode(0, 0);
 
-    size_t seg_len;
-    dtb_node* scan = state.root;
-    while (scan != NULL)
+    return make_cnode(header->nodes_offset, 0);
+}
+
+dtb_cnode dtb_compact_find(const void* tree, const char* path)
+{
+    dtb_cnode scan = dtb_compact_root(tree);
+    while (scan.offset != 0)
     {
         while (path[0] == '/')
             path++;
 
-        seg_len = string_find_char(path, '/');
+        size_t seg_len = string_find_char(path, '/');
         if (seg_len == -1ul)
             seg_len = string_len(path);
         if (seg_len == 0)
             return scan;
 
-        dtb_node* next = find_child_internal(scan, path, seg_len);
-        if (next == NULL)
-            next = dtb_create_child(scan, path);
-        scan = next;
+        scan = compact_find_child_internal(tree, scan, path, seg_len);
+        path += seg_len;
     }
 
-    return NULL;
+    return scan;
 }
 
-dtb_prop* dtb_find_or_create_prop(dtb_node* node, const char* name)
+dtb_cnode dtb_compact_find_child(const void* tree, dtb_cnode node, const char* name)
 {
-    if (node == NULL || name == NULL)
-        return NULL;
+    if (compact_header_of(tree) == NULL || node.offset == 0)
+        return make_cnode(0, 0);
 
-    dtb_prop* prop = dtb_find_prop(node, name);
-    if (prop == NULL)
-        prop = dtb_create_prop(node, name);
-    return prop;
+    return compact_find_child_internal(tree, node, name, string_len(name));
 }
 
-dtb_node* dtb_create_sibling(dtb_node* node, const char* name)
+dtb_cnode dtb_compact_get_child(const void* tree, dtb_cnode node)
 {
-    if (node == NULL || name == NULL || node->parent == NULL) /* creating siblings of root node is disallowed */
-        return NULL;
+    if (compact_header_of(tree) == NULL || node.offset == 0)
+        return make_cnode(0, 0);
 
-    struct name_collision_check check_data;
-    check_data.collision = false;
-    check_data.name = name;
-    check_data.name_len = string_len(name);
-    if (string_find_char(name, '/') < check_data.name_len)
-        check_data.name_len = string_find_char(name, '/');
+    struct compact_record record;
+    read_compact_record(tree, node.offset, &record);
+    const size_t child = compact_first_child(tree, &record);
+    if (child == record.end)
+        return make_cnode(0, 0);
 
-    do_foreach_sibling(node->parent->child, check_sibling_name_collisions, &check_data);
-    if (check_data.collision)
-    {
-        LOG_ERROR("Failed to create node with duplicate name.");
-        return NULL;
-    }
+    return make_cnode(child, node.offset);
+}
 
-    const size_t name_len = string_len(name);
-    char* name_buf = try_malloc(name_len + 1);
-    if (name_buf == NULL)
-        return NULL;
-    memcpy(name_buf, name, name_len);
+dtb_cnode dtb_compact_get_sibling(const void* tree, dtb_cnode node)
+{
+    if (compact_header_of(tree) == NULL || node.offset == 0 || node.parent == 0)
+        return make_cnode(0, 0);
+
+    struct compact_record record;
+    read_compact_record(tree, node.parent, &record);
+    const size_t parent_end = record.end;
+    read_compact_record(tree, node.offset, &record);
+    if (record.end == parent_end)
+        return make_cnode(0, 0);
+
+    return make_cnode(record.end, node.parent);
+}
+
+size_t dtb_compact_get_name(const void* tree, dtb_cnode node, char* buffer, size_t buffer_size)
+{
+    if (compact_header_of(tree) == NULL || node.offset == 0)
+        return 0;
 
-    dtb_node* sibling = try_malloc(sizeof(dtb_node));
-    if (sibling == NULL)
+    /* names depend on the previous sibling, so start from the first child of the parent */
+    struct compact_record record;
+    size_t offset = node.offset;
+    if (node.parent != 0)
     {
-        LOG_ERROR("Failed to allocate node for sibling.");
-        return NULL;
+        read_compact_record(tree, node.parent, &record);
+        offset = compact_first_child(tree, &record);
     }
 
-    sibling->name = name_buf;
-    sibling->parent = node->parent;
+    char name[COMPACT_NAME_MAX];
+    size_t name_len = 0;
+    while (true)
+    {
+        read_compact_record(tree, offset, &record);
+        memcpy(name + record.shared, record.suffix, record.suffix_len);
+        name_len = record.shared + record.suffix_len;
+        if (offset == node.offset)
+            break;
+        offset = record.end;
+    }
 
-    sibling->fromMalloc = true;
-    sibling->sibling = node->sibling;
-    node->sibling = sibling;
-    return sibling;
+    if (buffer != NULL && buffer_size != 0)
+    {
+        const size_t copy_len = name_len < buffer_size ? name_len : buffer_size - 1;
+        memcpy(buffer, name, copy_len);
+        buffer[copy_len] = 0;
+    }
+    return name_len;
 }
 
-dtb_node* dtb_create_child(dtb_node* node, const char* name)
+const void* dtb_compact_find_prop(const void* tree, dtb_cnode node, const char* name, size_t* length)
 {
-    if (node == NULL || name == NULL)
+    const struct compact_header* header = compact_header_of(tree);
+    if (header == NULL || node.offset == 0 || name == NULL)
         return NULL;
 
-    struct name_collision_check check_data;
-    check_data.collision = false;
-    check_data.name = name;
-    check_data.name_len = string_len(name);
-    if (string_find_char(name, '/') < check_data.name_len)
-        check_data.name_len = string_find_char(name, '/');
-
-    do_foreach_sibling(node->child, check_sibling_name_collisions, &check_data);
-    if (check_data.collision)
+    const uint8_t* base = tree;
+    const uint32_t* table = (const uint32_t*)(header + 1);
+    size_t low = 0;
+    size_t high = header->name_count;
+    while (low < high)
     {
-        LOG_ERROR("Failed to create node with duplicate name.");
-        return NULL;
+        const size_t mid = low + (high - low) / 2;
+        const int order = compare_strings((const char*)base + table[mid], name);
+        if (order == 0)
+        {
+            low = mid;
+            break;
+        }
+        if (order < 0)
+            low = mid + 1;
+        else
+            high = mid;
     }
-
-    const size_t name_len = string_len(name);
-    char* name_buf = try_malloc(name_len + 1);
-    if (name_buf == NULL)
+    if (low >= high)
         return NULL;
-    memcpy(name_buf, name, name_len);
 
-    dtb_node* child = try_malloc(sizeof(dtb_node));
-    if (child == NULL)
+    struct compact_record record;
+    read_compact_record(tree, node.offset, &record);
+    const uint8_t* scan = record.props;
+    for (size_t i = 0; i < record.prop_count; i++)
     {
-        LOG_ERROR("Failed to allocate node for child.");
-        return NULL;
+        const size_t id = read_varint(&scan);
+        const size_t prop_len = read_varint(&scan);
+        const size_t data_offset = prop_len != 0 ? read_varint(&scan) : 0;
+        if (id != low)
+            continue;
+
+        if (length != NULL)
+            *length = prop_len;
+        return base + header->pool_offset + data_offset;
     }
 
-    child->parent = node;
-    child->name = name_buf;
-    child->fromMalloc = true;
-    child->sibling = node->child;
-    node->child = child;
-    return child;
+    return NULL;
 }
 
-dtb_prop* dtb_create_prop(dtb_node* node, const char* name)
+/* ---- Section: Subtree Store ---- */
+
+/* The store hash-conses trees: names, property values and nodes are each kept once, keyed
+ * by their contents, and reference counted. A stored node refers to its name, its properties'
+ * names and values, and its children by pointer, and those are already unique, so two
+ * stored nodes are equal exactly when these pointers are. This keeps interning a node cheap
+ * and means equal subtrees from any context end up as the same entry.
+ */
+#define STORE_DATA 0
+#define STORE_NODE 1
+
+struct store_entry
 {
-    if (node == NULL || name == NULL)
-        return NULL;
+    struct store_entry* next;
+    size_t hash;
+    size_t refs;
+    size_t size; /* of the whole allocation */
+    size_t kind;
+    size_t length; /* in bytes for data, in items for nodes */
+};
 
-    const size_t name_len = string_len(name);
-    struct name_collision_check check_data;
-    check_data.collision = false;
-    check_data.name = name;
-    check_data.name_len = name_len;
+/* Data (names and property values) follows the entry directly. Node entries are followed
+ * by their name, then a name and value for each property, then each child.
+ */
+struct dtb_store_node_t
+{
+    struct store_entry entry;
+    size_t prop_count;
+    size_t child_count;
+};
 
-    do_foreach_prop(node, check_prop_name_collisions, &check_data);
-    if (check_data.collision)
-    {
-        LOG_ERROR("Failed to create prop with duplicate name.");
-        return NULL;
-    }
+struct dtb_store_t
+{
+    dtb_ops ops;
+    struct store_entry** buckets;
+    size_t capacity;
+    size_t data_count;
+    size_t node_count;
+    size_t bytes;
+};
 
-    char* name_buf = try_malloc(name_len + 1);
-    if (name_buf == NULL)
-        return NULL;
-    memcpy(name_buf, name, name_len);
+static size_t mix_hash(size_t hash, size_t value)
+{
+    hash ^= value + 0x9E3779B9u + (hash << 6) + (hash >> 2);
+    return hash;
+}
 
-    dtb_prop* prop = try_malloc(sizeof(dtb_prop));
-    if (prop == NULL)
-    {
-        LOG_ERROR("Failed to allocate property");
-        return NULL;
-    }
+static struct store_entry** store_node_items(dtb_store_node* node)
+{
+    return (struct store_entry**)(node + 1);
+}
 
-    prop->length = 0;
-    prop->data = NULL;
-    prop->name = name_buf;
-    prop->fromMalloc = true;
-    prop->dataFromMalloc = false;
-    prop->next = node->props;
-    prop->node = node;
-    node->props = prop;
-    return prop;
+static bool store_entries_eq(struct store_entry* a, struct store_entry* b)
+{
+    if (a->kind != b->kind || a->length != b->length)
+        return false;
+    if (a->kind == STORE_DATA)
+        return memory_eq(a + 1, b + 1, a->length);
+
+    dtb_store_node* a_node = (dtb_store_node*)a;
+    dtb_store_node* b_node = (dtb_store_node*)b;
+    return a_node->prop_count == b_node->prop_count
+        && memory_eq(store_node_items(a_node), store_node_items(b_node), a->length * sizeof(struct store_entry*));
 }
 
-bool dtb_destroy_node(dtb_node* node)
+static bool grow_store(dtb_store* store)
 {
-    if (node == NULL)
+    const size_t new_capacity = store->capacity * 2;
+    struct store_entry** buckets = store->ops.malloc(new_capacity * sizeof(struct store_entry*));
+    if (buckets == NULL)
         return false;
+    for (size_t i = 0; i < new_capacity; i++)
+        buckets[i] = NULL;
 
-    if (node->parent != NULL) /* break linkage in parents list of child nodes */
+    for (size_t i = 0; i < store->capacity; i++)
     {
-        dtb_node* scan = node->parent->child;
-        if (scan == node)
-        {
-            scan = NULL;
-            node->parent->child = node->sibling;
-        }
-
+        struct store_entry* scan = store->buckets[i];
         while (scan != NULL)
         {
-            if (scan->name == NULL)
-            {
-                LOG_ERROR("Corrupt internal state: node not in parent's child list.");
-                return false;
-            }
-            if (scan->sibling != node)
-            {
-                scan = scan->sibling;
-                continue;
-            }
-
-            scan->sibling = node->sibling;
-            break;
+            struct store_entry* next = scan->next;
+            const size_t slot = scan->hash & (new_capacity - 1);
+            scan->next = buckets[slot];
+            buckets[slot] = scan;
+            scan = next;
         }
     }
 
-    node->parent = NULL;
-    destroy_dead_node(node);
+    store->ops.free(store->buckets, store->capacity * sizeof(struct store_entry*));
+    store->buckets = buckets;
+    store->capacity = new_capacity;
     return true;
 }
 
-bool dtb_destroy_prop(dtb_prop* prop)
-{
-    if (prop == NULL)
-        return false;
+static void release_entry(dtb_store* store, struct store_entry* entry);
 
-    dtb_prop* scan = prop->node->props;
-    if (scan == prop)
+/* Frees an entry that isn't in the table, dropping the references it holds. */
+static void free_entry(dtb_store* store, struct store_entry* entry)
+{
+    if (entry->kind == STORE_NODE)
     {
-        scan = NULL;
-        prop->node->props = prop->next;
+        struct store_entry** items = store_node_items((dtb_store_node*)entry);
+        for (size_t i = 0; i < entry->length; i++)
+            release_entry(store, items[i]);
     }
+    store->ops.free(entry, entry->size);
+}
 
-    while (scan != NULL)
+static void release_entry(dtb_store* store, struct store_entry* entry)
+{
+    if (entry == NULL || --entry->refs != 0)
+        return;
+
+    struct store_entry** link = &store->buckets[entry->hash & (store->capacity - 1)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+
+    if (entry->kind == STORE_NODE)
+        store->node_count--;
+    else
+        store->data_count--;
+    store->bytes -= entry->size;
+    free_entry(store, entry);
+}
+
+/* Takes ownership of `candidate`: either it's added to the store, or it's freed and the
+ * matching entry is used instead. Returns the entry with one more reference, or NULL if the
+ * store couldn't grow.
+ */
+static struct store_entry* insert_entry(dtb_store* store, struct store_entry* candidate)
+{
+    struct store_entry* scan = store->buckets[candidate->hash & (store->capacity - 1)];
+    for (; scan != NULL; scan = scan->next)
     {
-        if (scan->next == NULL)
-            return false;
-        if (scan->next != prop)
+        if (scan->hash == candidate->hash && store_entries_eq(scan, candidate))
         {
-            scan = scan->next;
-            continue;
+            scan->refs++;
+            free_entry(store, candidate);
+            return scan;
         }
+    }
 
-        scan->next = prop->next;
-        break;
+    if (store->data_count + store->node_count >= store->capacity && !grow_store(store))
+    {
+        free_entry(store, candidate);
+        return NULL;
     }
 
-    if (prop->dataFromMalloc)
-        try_free(prop->data, prop->length);
-    if (prop->fromMalloc)
-        try_free(prop, sizeof(dtb_prop));
+    const size_t slot = candidate->hash & (store->capacity - 1);
+    candidate->refs = 1;
+    candidate->next = store->buckets[slot];
+    store->buckets[slot] = candidate;
+    if (candidate->kind == STORE_NODE)
+        store->node_count++;
+    else
+        store->data_count++;
+    store->bytes += candidate->size;
+    return candidate;
+}
 
-    return true;
+static struct store_entry* intern_data(dtb_store* store, const void* data, size_t length)
+{
+    const size_t size = sizeof(struct store_entry) + length;
+    struct store_entry* entry = store->ops.malloc(size);
+    if (entry == NULL)
+        return NULL;
+
+    entry->hash = mix_hash(payload_hash(data, length), STORE_DATA);
+    entry->size = size;
+    entry->kind = STORE_DATA;
+    entry->length = length;
+    memcpy(entry + 1, data, length);
+    return insert_entry(store, entry);
 }
 
-static bool ensure_prop_has_buffer_for(dtb_prop* prop, size_t buf_size)
+static struct store_entry* intern_node(dtb_store* store, dtb_node* node)
 {
-    if (prop == NULL)
-        return false;
+    size_t prop_count = 0;
+    size_t child_count = 0;
+    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+        prop_count++;
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+        child_count++;
+
+    const size_t item_count = 1 + prop_count * 2 + child_count;
+    const size_t size = sizeof(dtb_store_node) + item_count * sizeof(struct store_entry*);
+    dtb_store_node* stored = store->ops.malloc(size);
+    if (stored == NULL)
+        return NULL;
 
-    if (prop->dataFromMalloc && buf_size <= prop->length)
-        return true;
+    stored->entry.size = size;
+    stored->entry.kind = STORE_NODE;
+    stored->entry.length = item_count;
+    stored->prop_count = prop_count;
+    stored->child_count = child_count;
+
+    struct store_entry** items = store_node_items(stored);
+    for (size_t i = 0; i < item_count; i++)
+        items[i] = NULL;
+
+    /* the root has no name of its own, store it as an empty one */
+    const char* name = node->name == NULL ? "" : node->name;
+    bool success = (items[0] = intern_data(store, name, string_len(name) + 1)) != NULL;
+    size_t next = 1;
+    for (dtb_prop* prop = node->props; prop != NULL && success; prop = prop->next)
+    {
+        items[next] = intern_data(store, prop->name, string_len(prop->name) + 1);
+        items[next + 1] = intern_data(store, prop->data, prop->length);
+        success = items[next] != NULL && items[next + 1] != NULL;
+        next += 2;
+    }
+    for (dtb_node* child = node->child; child != NULL && success; child = child->sibling)
+        success = (items[next++] = intern_node(store, child)) != NULL;
 
-    void* new_data = try_malloc(buf_size);
-    if (new_data == NULL)
-        return false;
-    if (prop->dataFromMalloc)
-        try_free(prop->data, prop->length);
+    if (!success)
+    {
+        free_entry(store, &stored->entry);
+        return NULL;
+    }
 
-    prop->data = new_data;
-    prop->length = buf_size;
-    return true;
+    size_t hash = STORE_NODE;
+    for (size_t i = 0; i < item_count; i++)
+        hash = mix_hash(hash, (uintptr_t)items[i]);
+    stored->entry.hash = mix_hash(hash, prop_count);
+    return insert_entry(store, &stored->entry);
 }
 
-bool dtb_write_prop_string(dtb_prop* prop, const char* str, size_t str_len)
+dtb_store* dtb_store_create(dtb_ops ops)
 {
-    if (prop == NULL)
-        return false;
+    if (ops.malloc == NULL || ops.free == NULL)
+        return NULL;
 
-    if (!ensure_prop_has_buffer_for(prop, str_len))
-        return false;
+    dtb_store* store = ops.malloc(sizeof(dtb_store));
+    if (store == NULL)
+        return NULL;
 
-    memcpy(prop->data, str, str_len);
-    return true;
+    store->ops = ops;
+    store->capacity = 64;
+    store->data_count = 0;
+    store->node_count = 0;
+    store->bytes = 0;
+    store->buckets = ops.malloc(store->capacity * sizeof(struct store_entry*));
+    if (store->buckets == NULL)
+    {
+        ops.free(store, sizeof(dtb_store));
+        return NULL;
+    }
+    for (size_t i = 0; i < store->capacity; i++)
+        store->buckets[i] = NULL;
+
+    return store;
 }
 
-static bool copy_prop_buffer(dtb_prop* prop, size_t buf_cells, const uint32_t* buf)
+void dtb_store_destroy(dtb_store* store)
 {
-    if (prop == NULL)
-        return false;
-    if (buf == NULL && buf_cells != 0)
-        return false;
+    if (store == NULL)
+        return;
 
-    if (!ensure_prop_has_buffer_for(prop, buf_cells * FDT_CELL_SIZE))
-        return false;
+    /* every entry is in the table, so references between them can be ignored */
+    for (size_t i = 0; i < store->capacity; i++)
+    {
+        struct store_entry* scan = store->buckets[i];
+        while (scan != NULL)
+        {
+            struct store_entry* next = scan->next;
+            store->ops.free(scan, scan->size);
+            scan = next;
+        }
+    }
 
-    uint32_t* dest_cells = prop->data;
-    for (size_t i = 0; i < buf_cells; i++)
-        dest_cells[i] = be32(buf[i]);
+    store->ops.free(store->buckets, store->capacity * sizeof(struct store_entry*));
+    store->ops.free(store, sizeof(dtb_store));
+}
 
-    return true;
+const dtb_store_node* dtb_store_intern(dtb_store* store, dtb_node* node)
+{
+    if (store == NULL || node == NULL)
+        return NULL;
+
+    return (const dtb_store_node*)intern_node(store, node);
 }
 
-bool dtb_write_prop_1(dtb_prop* prop, size_t count, size_t cell_count, const uintmax_t* vals)
+void dtb_store_release(dtb_store* store, const dtb_store_node* node)
 {
-    const size_t buf_cells = count * cell_count;
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    if (store == NULL || node == NULL)
+        return;
+
+    release_entry(store, (struct store_entry*)&node->entry);
 }
 
-bool dtb_write_prop_2(dtb_prop* prop, size_t count, dtb_pair layout, const dtb_pair* vals)
+bool dtb_stat_store(dtb_store* store, dtb_store_stat* stat)
 {
-    const size_t buf_cells = count * (layout.a + layout.b);
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    if (store == NULL || stat == NULL)
+        return false;
+
+    stat->node_count = store->node_count;
+    stat->data_count = store->data_count;
+    stat->bytes = store->bytes + sizeof(dtb_store) + store->capacity * sizeof(struct store_entry*);
+    return true;
 }
 
-bool dtb_write_prop_3(dtb_prop* prop, size_t count, dtb_triplet layout, const dtb_triplet* vals)
+#ifdef SMOLDTB_ENABLE_WRITE_API
+/* Children and properties are created at the front of their lists, so they're added in
+ * reverse to keep their original order. */
+static bool instantiate_into(dtb_node* dest, const dtb_store_node* node)
 {
-    const size_t buf_cells = count * (layout.a + layout.b + layout.c);
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    struct store_entry** items = store_node_items((dtb_store_node*)node);
+    for (size_t i = node->prop_count; i > 0; i--)
+    {
+        struct store_entry* name = items[1 + (i - 1) * 2];
+        struct store_entry* value = items[2 + (i - 1) * 2];
+        dtb_prop* prop = dtb_find_or_create_prop(dest, (const char*)(name + 1));
+        if (!dtb_write_prop_borrowed(prop, value + 1, value->length))
+            return false;
+    }
+
+    struct store_entry** children = items + 1 + node->prop_count * 2;
+    for (size_t i = node->child_count; i > 0; i--)
+    {
+        const dtb_store_node* child = (const dtb_store_node*)children[i - 1];
+        dtb_node* copy = dtb_create_child(dest, (const char*)(store_node_items((dtb_store_node*)child)[0] + 1));
+        if (copy == NULL || !instantiate_into(copy, child))
+            return false;
+    }
+
+    return true;
 }
 
-bool dtb_write_prop_4(dtb_prop* prop, size_t count, dtb_quad layout, const dtb_quad* vals)
+/* The new properties borrow their values from the store, so each instantiation holds a
+ * reference to the stored node (which keeps everything below it alive). Failing partway is
+ * rolled back, so there's never anything borrowed without that reference.
+ */
+dtb_node* dtb_store_instantiate(const dtb_store_node* node, dtb_node* parent)
 {
-    const size_t buf_cells = count * (layout.a + layout.b + layout.c + layout.d);
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    if (node == NULL)
+        return NULL;
+
+    const size_t snapshot = dtb_snapshot();
+    if (snapshot == SMOLDTB_SNAPSHOT_FAILURE)
+        return NULL;
+
+    dtb_node* dest;
+    if (parent == NULL)
+        dest = dtb_find_or_create_node("/");
+    else
+        dest = dtb_create_child(parent, (const char*)(store_node_items((dtb_store_node*)node)[0] + 1));
+
+    if (dest == NULL || !instantiate_into(dest, node))
+    {
+        dtb_rollback(snapshot);
+        return NULL;
+    }
+
+    dtb_release_snapshot(snapshot);
+    ((dtb_store_node*)node)->entry.refs++;
+    return dest;
 }
-#endif /* SMOLDTB_ENABLE_WRITE_API */
+#endif
@@ -10,8 +10,13 @@ extern "C" {
 
 #define SMOLDTB_INIT_EMPTY_TREE 0
 
+#define SMOLDTB_INIT_DONE 0
+#define SMOLDTB_INIT_MORE 1
+#define SMOLDTB_INIT_FAILED (-1)
+
 typedef struct dtb_node_t dtb_node;
 typedef struct dtb_prop_t dtb_prop;
+typedef struct dtb_ctx_t dtb_ctx;
 
 typedef struct
 {
@@ -56,9 +61,48 @@ typedef struct
     size_t data_len;
 } dtb_prop_stat;
 
+/* Limits which parts of the blob are parsed. A node is skipped (with its children) if
+ * `skip_disabled` is set and its status is "disabled", or `keep_node` returns false. If
+ * `keep_paths` is set (a NULL-terminated list of globs), only nodes matching one (and their
+ * children) are kept, plus the ancestors needed to reach them. Top-level nodes are always kept.
+ */
+typedef struct
+{
+    const char* const* keep_paths;
+    bool (*keep_node)(const char* path, const char* name, void* opaque);
+    bool skip_disabled;
+    void* opaque;
+} dtb_parse_filter;
+
 size_t dtb_query_total_size(uintptr_t fdt_start);
+uintptr_t dtb_select_concatenated(uintptr_t start, size_t length, const char* const* compatibles, const char* model);
+uintptr_t dtb_select_from_table(const uintptr_t* blobs, size_t count, const char* const* compatibles, const char* model);
 
 bool smoldtb_init(uintptr_t start, dtb_ops ops);
+bool smoldtb_init_filtered(uintptr_t start, dtb_ops ops, const dtb_parse_filter* filter);
+bool smoldtb_reinit_incremental(uintptr_t start, const dtb_parse_filter* filter);
+bool dtb_init_begin(dtb_ctx* ctx, uintptr_t start, dtb_ops ops, const dtb_parse_filter* filter);
+int dtb_init_step(dtb_ctx* ctx, size_t budget);
+
+dtb_ctx* dtb_ctx_create(dtb_ops ops);
+void dtb_ctx_destroy(dtb_ctx* ctx);
+dtb_ctx* dtb_ctx_select(dtb_ctx* ctx);
+dtb_ctx* dtb_ctx_current();
+bool smoldtb_reinit_atomic(uintptr_t start, dtb_ops ops, void (*retire)(dtb_ctx* old, void* opaque), void* opaque);
+void dtb_defer_indexes(dtb_ctx* ctx, bool defer);
+bool dtb_build_indexes(dtb_ctx* ctx);
+
+/* A reference to a node or property that can detect when it's gone stale. */
+typedef struct
+{
+    uint32_t index;
+    uint64_t generation;
+} dtb_ref;
+
+dtb_ref dtb_get_node_ref(dtb_node* node);
+dtb_ref dtb_get_prop_ref(dtb_prop* prop);
+dtb_node* dtb_resolve_node(dtb_ref ref);
+dtb_prop* dtb_resolve_prop(dtb_ref ref);
 
 dtb_node* dtb_find_compatible(dtb_node* node, const char* str);
 dtb_node* dtb_find_phandle(unsigned handle);
@@ -67,6 +111,7 @@ dtb_node* dtb_find_child(dtb_node* node, const char* name);
 dtb_prop* dtb_find_prop(dtb_node* node, const char* name);
 
 dtb_node* dtb_get_sibling(dtb_node* node);
+dtb_node* dtb_get_prev_sibling(dtb_node* node);
 dtb_node* dtb_get_child(dtb_node* node);
 dtb_node* dtb_get_parent(dtb_node* node);
 dtb_prop* dtb_get_prop(dtb_node* node, size_t index);
@@ -84,21 +129,172 @@ size_t dtb_read_prop_2(dtb_prop* prop, dtb_pair layout, dtb_pair* vals);
 size_t dtb_read_prop_3(dtb_prop* prop, dtb_triplet layout, dtb_triplet* vals);
 size_t dtb_read_prop_4(dtb_prop* prop, dtb_quad layout, dtb_quad* vals);
 
+#define SMOLDTB_CHECK_MISSING_PROVIDER 0
+#define SMOLDTB_CHECK_MISSING_CELLS 1
+#define SMOLDTB_CHECK_BAD_ARG_COUNT 2
+#define SMOLDTB_CHECK_DUPLICATE_PHANDLE 3
+#define SMOLDTB_CHECK_BAD_PHANDLE 4
+
+/* A problem found by dtb_check_phandles(). `prop` is the property with the problem (the
+ * referencing property, or the node's own phandle), `handle` the phandle involved (if any),
+ * and `provider` the referenced node, or the other owner of a duplicate phandle.
+ */
+typedef struct
+{
+    size_t kind;
+    dtb_node* node;
+    dtb_prop* prop;
+    uint32_t handle;
+    dtb_node* provider;
+} dtb_check_issue;
+
+size_t dtb_check_phandles(bool (*report)(const dtb_check_issue* issue, void* opaque), void* opaque);
+
+#define SMOLDTB_DIFF_ADD_NODE 0
+#define SMOLDTB_DIFF_REMOVE_NODE 1
+#define SMOLDTB_DIFF_SET_PROP 2
+#define SMOLDTB_DIFF_REMOVE_PROP 3
+
+/* A single change required to turn one tree into another. `target` is always a node
+ * from the original tree: the parent for node additions/removals, or the owner of the
+ * property for property changes. `node` and `prop` point to whatever is being added
+ * (from the new tree) or removed (from the original tree).
+ */
+typedef struct
+{
+    size_t kind;
+    dtb_node* target;
+    dtb_node* node;
+    dtb_prop* prop;
+} dtb_diff_op;
+
+size_t dtb_diff(dtb_node* from, dtb_node* to, bool (*emit)(const dtb_diff_op* op, void* opaque), void* opaque);
+
+#define SMOLDTB_COMPACT_DEDUP (1 << 0)
+#define SMOLDTB_COMPACT_FAILURE ((size_t)-1)
+
+/* A node within a compact tree, `offset` is zero if the node doesn't exist. */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t parent;
+} dtb_cnode;
+
+size_t dtb_compact(dtb_node* root, void* buffer, size_t buffer_size, size_t flags);
+dtb_cnode dtb_compact_root(const void* tree);
+dtb_cnode dtb_compact_find(const void* tree, const char* path);
+dtb_cnode dtb_compact_find_child(const void* tree, dtb_cnode node, const char* name);
+dtb_cnode dtb_compact_get_child(const void* tree, dtb_cnode node);
+dtb_cnode dtb_compact_get_sibling(const void* tree, dtb_cnode node);
+size_t dtb_compact_get_name(const void* tree, dtb_cnode node, char* buffer, size_t buffer_size);
+const void* dtb_compact_find_prop(const void* tree, dtb_cnode node, const char* name, size_t* length);
+
+/* A store holds immutable nodes that can be shared between any number of trees. */
+typedef struct dtb_store_t dtb_store;
+typedef struct dtb_store_node_t dtb_store_node;
+
+typedef struct
+{
+    size_t node_count;
+    size_t data_count;
+    size_t bytes;
+} dtb_store_stat;
+
+dtb_store* dtb_store_create(dtb_ops ops);
+void dtb_store_destroy(dtb_store* store);
+const dtb_store_node* dtb_store_intern(dtb_store* store, dtb_node* node);
+void dtb_store_release(dtb_store* store, const dtb_store_node* node);
+bool dtb_stat_store(dtb_store* store, dtb_store_stat* stat);
+
 #ifdef SMOLDTB_ENABLE_WRITE_API
 #define SMOLDTB_FINALISE_FAILURE ((size_t)-1)
+#define SMOLDTB_OVERLAY_LOSSY ((size_t)-2)
+
+size_t dtb_diff_to_overlay(dtb_node* from, dtb_node* to, void* buffer, size_t buffer_size, size_t* dropped);
+dtb_node* dtb_store_instantiate(const dtb_store_node* node, dtb_node* parent);
+
+/* Describes a property whose value will be replaced in copies of a finalised blob.
+ * `prop` and `capacity` are filled in by the caller, `offset` is set by dtb_finalise_template().
+ */
+typedef struct
+{
+    dtb_prop* prop;
+    size_t capacity;
+    size_t offset;
+} dtb_template_slot;
 
 size_t dtb_finalise_to_buffer(void* buffer, size_t buffer_size, uint32_t boot_cpu_id);
+size_t dtb_finalise_template(void* buffer, size_t buffer_size, uint32_t boot_cpu_id, dtb_template_slot* slots, size_t slot_count);
+bool dtb_template_patch(void* blob, const dtb_template_slot* slot, const void* data, size_t length);
+
+#define SMOLDTB_SUBTREE_SYNTH_ROOT (1 << 0)
+#define SMOLDTB_SUBTREE_WITH_PROVIDERS (1 << 1)
+
+size_t dtb_finalise_subtree(dtb_node* node, void* buffer, size_t buffer_size, size_t flags);
+
+/* Controls what dtb_copy_filtered() copies. All lists are NULL-terminated and optional.
+ * Nodes matching a deny rule are skipped along with their children. If any allow rules are set,
+ * only nodes matching one (and their children) are copied, plus the ancestors needed to reach them.
+ * Paths and property names are matched as globs ('*' and '?'). `rewrite_prop` can replace the data
+ * of a copied property (it is copied straight away), or return false to drop it.
+ */
+typedef struct
+{
+    const char* const* allow_compatible;
+    const char* const* deny_compatible;
+    const char* const* allow_paths;
+    const char* const* deny_paths;
+    const char* const* deny_props;
+    bool (*filter_node)(dtb_node* node, void* opaque);
+    bool (*rewrite_prop)(dtb_node* node, dtb_prop* prop, const void** data, size_t* length, void* opaque);
+    void* opaque;
+} dtb_copy_filter;
+
+bool dtb_copy_filtered(dtb_node* src, const dtb_copy_filter* filter);
+size_t dtb_copy_filtered_to_buffer(dtb_node* src, const dtb_copy_filter* filter, void* buffer, size_t buffer_size, uint32_t boot_cpu_id);
+dtb_ctx* dtb_clone(dtb_node* node);
+
+#define SMOLDTB_BUILD_EMPTY 0
+#define SMOLDTB_BUILD_U32 1
+#define SMOLDTB_BUILD_U64 2
+#define SMOLDTB_BUILD_STRING 3
+#define SMOLDTB_BUILD_STRINGS 4
+#define SMOLDTB_BUILD_BYTES 5
+
+/* A single entry for dtb_build(). If `name` is NULL only the node at `path` is created.
+ * `data` points to an array of `count` uint32_t, uint64_t or const char* (for STRINGS),
+ * a single string for STRING, or `count` raw bytes for BYTES.
+ */
+typedef struct
+{
+    const char* path;
+    const char* name;
+    size_t type;
+    const void* data;
+    size_t count;
+} dtb_build_record;
+
+bool dtb_build(const dtb_build_record* records, size_t count);
+
+#define SMOLDTB_SNAPSHOT_FAILURE ((size_t)-1)
+
+size_t dtb_snapshot();
+bool dtb_rollback(size_t snapshot);
+void dtb_release_snapshot(size_t snapshot);
 
 dtb_node* dtb_find_or_create_node(const char* path);
 dtb_prop* dtb_find_or_create_prop(dtb_node* node, const char* name);
 dtb_node* dtb_create_sibling(dtb_node* node, const char* name);
+dtb_node* dtb_create_sibling_before(dtb_node* node, const char* name);
 dtb_node* dtb_create_child(dtb_node* node, const char* name);
 dtb_prop* dtb_create_prop(dtb_node* node, const char* name);
+unsigned dtb_alloc_phandle(dtb_node* node);
 
 bool dtb_destroy_node(dtb_node* node);
 bool dtb_destroy_prop(dtb_prop* prop);
 
 bool dtb_write_prop_string(dtb_prop* prop, const char* str, size_t str_len);
+bool dtb_write_prop_borrowed(dtb_prop* prop, const void* data, size_t length);
 bool dtb_write_prop_1(dtb_prop* prop, size_t count, size_t cell_count, const uintmax_t* vals);
 bool dtb_write_prop_2(dtb_prop* prop, size_t count, dtb_pair layout, const dtb_pair* vals);
 bool dtb_write_prop_3(dtb_prop* prop, size_t count, dtb_triplet layout, const dtb_triplet* vals);
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "smoldtb.h"
+
+/* Runs every read API from several threads against one tree, so the lazily built lookup
+ * indexes are raced for. Build with `make tsan`, which runs this under ThreadSanitizer.
+ * Results are checked against answers worked out beforehand on a single thread.
+ */
+
+#define THREAD_COUNT 8
+#define ITERATIONS 200
+#define MAX_NODES 512
+#define PATH_MAX_LEN 256
+
+struct node_info
+{
+    dtb_node* node;
+    char path[PATH_MAX_LEN];
+    const char* compatible;
+    dtb_node* first_compatible;
+    unsigned phandle;
+};
+
+static struct node_info nodes[MAX_NODES];
+static size_t node_count = 0;
+static pthread_barrier_t start_barrier;
+static size_t mismatch_count = 0;
+static bool build_indexes_in_thread = false;
+
+void dtb_on_error(const char* why)
+{
+    printf("smoldtb error: %s\r\n", why);
+}
+
+void* dtb_malloc(size_t length)
+{
+    return malloc(length);
+}
+
+void dtb_free(void* ptr, size_t length)
+{
+    (void)length;
+    free(ptr);
+}
+
+static void report_mismatch(const char* what, const char* path)
+{
+    __atomic_add_fetch(&mismatch_count, 1, __ATOMIC_RELAXED);
+    printf("mismatch: %s for %s\r\n", what, path);
+}
+
+static void collect_nodes(dtb_node* node, const char* parent_path)
+{
+    if (node == NULL || node_count == MAX_NODES)
+        return;
+
+    struct node_info* info = &nodes[node_count++];
+    info->node = node;
+
+    dtb_node_stat stat;
+    dtb_stat_node(node, &stat);
+    if (dtb_get_parent(node) == NULL)
+        snprintf(info->path, PATH_MAX_LEN, "/");
+    else
+        snprintf(info->path, PATH_MAX_LEN, "%s/%s", strcmp(parent_path, "/") == 0 ? "" : parent_path, stat.name);
+
+    info->compatible = dtb_read_prop_string(dtb_find_prop(node, "compatible"), 0);
+    info->phandle = 0;
+    dtb_prop* phandle = dtb_find_prop(node, "phandle");
+    uintmax_t value;
+    if (phandle != NULL && dtb_read_prop_1(phandle, 1, &value) == 1)
+        info->phandle = value;
+
+    for (dtb_node* child = dtb_get_child(node); child != NULL; child = dtb_get_sibling(child))
+        collect_nodes(child, info->path);
+}
+
+/* The first node (depth-first) with a compatible string, found without using any index. */
+static void find_first_compatibles()
+{
+    for (size_t i = 0; i < node_count; i++)
+    {
+        nodes[i].first_compatible = NULL;
+        if (nodes[i].compatible == NULL)
+            continue;
+
+        for (size_t j = 0; j < node_count && nodes[i].first_compatible == NULL; j++)
+        {
+            if (dtb_is_compatible(nodes[j].node, nodes[i].compatible))
+                nodes[i].first_compatible = nodes[j].node;
+        }
+    }
+}
+
+static void check_node(const struct node_info* info)
+{
+    if (dtb_find(info->path) != info->node)
+        report_mismatch("dtb_find()", info->path);
+
+    if (info->compatible != NULL)
+    {
+        if (dtb_find_compatible(NULL, info->compatible) != info->first_compatible)
+            report_mismatch("dtb_find_compatible()", info->path);
+        if (!dtb_is_compatible(info->node, info->compatible))
+            report_mismatch("dtb_is_compatible()", info->path);
+    }
+
+    if (info->phandle != 0 && dtb_find_phandle(info->phandle) != info->node)
+        report_mismatch("dtb_find_phandle()", info->path);
+
+    dtb_node* parent = dtb_get_parent(info->node);
+    if (parent != NULL)
+    {
+        dtb_node_stat stat;
+        dtb_stat_node(info->node, &stat);
+        if (dtb_find_child(parent, stat.name) != info->node)
+            report_mismatch("dtb_find_child()", info->path);
+        dtb_get_addr_cells_for(info->node);
+        dtb_get_size_cells_for(info->node);
+    }
+
+    dtb_node_stat stat;
+    if (!dtb_stat_node(info->node, &stat))
+        report_mismatch("dtb_stat_node()", info->path);
+
+    for (size_t i = 0; i < stat.prop_count; i++)
+    {
+        dtb_prop* prop = dtb_get_prop(info->node, i);
+        dtb_prop_stat pstat;
+        if (prop == NULL || !dtb_stat_prop(prop, &pstat))
+        {
+            report_mismatch("dtb_get_prop()", info->path);
+            continue;
+        }
+        if (dtb_find_prop(info->node, pstat.name) != prop)
+            report_mismatch("dtb_find_prop()", info->path);
+
+        /* the read functions fill in every entry, so only read properties that fit */
+        uintmax_t cells[64];
+        if (dtb_read_prop_1(prop, 1, NULL) <= 64)
+            dtb_read_prop_1(prop, 1, cells);
+        dtb_pair pair_layout = { 1, 1 };
+        dtb_pair pairs[32];
+        if (dtb_read_prop_2(prop, pair_layout, NULL) <= 32)
+            dtb_read_prop_2(prop, pair_layout, pairs);
+        dtb_read_prop_string(prop, 0);
+    }
+
+    dtb_get_addr_cells_of(info->node);
+    dtb_get_size_cells_of(info->node);
+    dtb_get_prev_sibling(info->node);
+}
+
+static void* reader_thread(void* arg)
+{
+    const size_t index = (size_t)arg;
+    pthread_barrier_wait(&start_barrier);
+
+    if (index == 0 && build_indexes_in_thread)
+        dtb_build_indexes(NULL);
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        /* each thread starts somewhere else, so different lookups race to build the indexes */
+        for (size_t j = 0; j < node_count; j++)
+            check_node(&nodes[(j + index * 7 + i) % node_count]);
+    }
+
+    return NULL;
+}
+
+static bool run_round(const char* name)
+{
+    pthread_t threads[THREAD_COUNT];
+    pthread_barrier_init(&start_barrier, NULL, THREAD_COUNT);
+    for (size_t i = 0; i < THREAD_COUNT; i++)
+        pthread_create(&threads[i], NULL, reader_thread, (void*)i);
+    for (size_t i = 0; i < THREAD_COUNT; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("%s: %zu nodes, %d threads, %zu mismatches\r\n", name, node_count, THREAD_COUNT, mismatch_count);
+    return mismatch_count == 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        printf("Usage: tsan_stress <filename.dtb>\r\n");
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+    {
+        printf("Could not open file %s\r\n", argv[1]);
+        return 1;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        printf("Could not stat file %s\r\n", argv[1]);
+        return 1;
+    }
+
+    void* buffer = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buffer == MAP_FAILED)
+    {
+        printf("mmap() failed\r\n");
+        return 1;
+    }
+
+    dtb_ops ops;
+    ops.malloc = dtb_malloc;
+    ops.free = dtb_free;
+    ops.on_error = dtb_on_error;
+
+    /* the answers are worked out with deferred indexes, so the threads are first to build them */
+    dtb_defer_indexes(NULL, true);
+    if (!smoldtb_init((uintptr_t)buffer, ops))
+        return 1;
+    collect_nodes(dtb_find("/"), "");
+    find_first_compatibles();
+
+    /* round 1: readers build the indexes on first use */
+    dtb_defer_indexes(NULL, false);
+    bool success = run_round("lazy indexes");
+
+    /* round 2: a background worker builds the indexes while the others read */
+    dtb_defer_indexes(NULL, true);
+    smoldtb_init((uintptr_t)buffer, ops);
+    node_count = 0;
+    collect_nodes(dtb_find("/"), "");
+    find_first_compatibles();
+    build_indexes_in_thread = true;
+    success = run_round("deferred indexes") && success;
+
+    munmap(buffer, sb.st_size);
+    close(fd);
+    return success ? 0 : 1;
+}